@@ -0,0 +1,267 @@
+/* Batched simulation of many games on a thread pool, see batch.h.
+ *
+ * The games of a step are split into chunks and every worker starts with an
+ * equal, contiguous range of them. A worker takes chunks from the front of
+ * its own range; once that is empty it steals the back half of another
+ * worker's range, so threads that fall behind (descheduled, slower cores,
+ * games that cost more) are helped instead of waited for. A range is one
+ * 64-bit word, begin << 32 | end, changed only by compare-and-swap, so taking
+ * and stealing need no locks. The caller's thread works as worker 0. */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "batch.h"
+
+/* Games per chunk: enough work to make taking a chunk cheap in comparison,
+ * few enough that there is something left to steal. */
+#define BATCH_CHUNK (64)
+
+struct partida {
+    struct juego juego;
+    struct campo campo;
+    bool nivel2; /* level 2 has been set up */
+};
+
+struct worker {
+    _Atomic u64 range; /* chunks left to run: begin << 32 | end */
+    pthread_t thread;
+    struct batch *batch;
+    u32 id;
+} __attribute__((aligned(64)));
+
+struct batch {
+    u32 n, threads, chunks;
+    struct partida *partidas;
+    struct worker *workers;
+
+    /* Arguments of the step being run. */
+    const u8 *inputs;
+    u8 *cells;
+    s32 *rewards;
+    u8 *done;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, finished;
+    u64 generation; /* number of steps started */
+    u32 running;    /* workers still busy with the current step */
+    bool quit;
+};
+
+static void nueva(struct partida *p)
+{
+    p->juego.campo = &p->campo;
+    juego_nuevo(&p->juego);
+    spawn(&p->juego);
+    p->nivel2 = false;
+}
+
+static void step_one(struct batch *b, u32 i)
+{
+    struct partida *p = &b->partidas[i];
+    struct juego *j = &p->juego;
+    u32 score = j->score, vidas = j->vidas;
+
+    juego_tick(j, b->inputs[i], 0, BATCH_UPDATE_EVERY);
+    j->sonidos = 0;
+    if (!j->level2)
+        check_level_change(j);
+    if (j->level2 && !p->nivel2) {
+        inicializar2(j);
+        p->nivel2 = true;
+    }
+
+    s32 reward = (s32) (j->score - score) - (s32) (vidas - j->vidas) * BATCH_LIFE_PENALTY;
+    bool over = j->game_over || (s32) j->vidas <= 0 ||
+                (j->level2 && j->score >= j->reglas.puntos_fin);
+    if (over)
+        nueva(p);
+
+    if (b->rewards)
+        b->rewards[i] = reward;
+    if (b->done)
+        b->done[i] = over;
+    if (b->cells)
+        juego_observar(j, (u8 (*)[WELL_WIDTH]) (b->cells + (usize) i * BATCH_CELLS));
+}
+
+static void run_chunk(struct batch *b, u32 chunk)
+{
+    u32 end = (chunk + 1) * BATCH_CHUNK;
+    if (end > b->n)
+        end = b->n;
+    for (u32 i = chunk * BATCH_CHUNK; i < end; i++)
+        step_one(b, i);
+}
+
+/* Take the first chunk of w's own range, or return -1 if it is empty. */
+static s64 take(struct worker *w)
+{
+    u64 r = atomic_load(&w->range);
+    for (;;) {
+        u32 begin = r >> 32, end = (u32) r;
+        if (begin >= end)
+            return -1;
+        if (atomic_compare_exchange_weak(&w->range, &r, (u64) (begin + 1) << 32 | end))
+            return begin;
+    }
+}
+
+/* Move the back half of victim's range to thief, whose range is empty.
+ * Return false if victim had nothing left. */
+static bool steal(struct worker *thief, struct worker *victim)
+{
+    u64 r = atomic_load(&victim->range);
+    for (;;) {
+        u32 begin = r >> 32, end = (u32) r;
+        if (begin >= end)
+            return false;
+        u32 mid = end - (end - begin + 1) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &r, (u64) begin << 32 | mid)) {
+            atomic_store(&thief->range, (u64) mid << 32 | end);
+            return true;
+        }
+    }
+}
+
+/* Run chunks until no worker has any left. */
+static void work(struct worker *w)
+{
+    struct batch *b = w->batch;
+    for (;;) {
+        s64 chunk;
+        while ((chunk = take(w)) >= 0)
+            run_chunk(b, chunk);
+
+        bool stolen = false;
+        for (u32 i = 1; i < b->threads && !stolen; i++)
+            stolen = steal(w, &b->workers[(w->id + i) % b->threads]);
+        if (!stolen)
+            return;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *b = w->batch;
+    u64 seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        while (b->generation == seen && !b->quit)
+            pthread_cond_wait(&b->start, &b->lock);
+        if (b->quit) {
+            pthread_mutex_unlock(&b->lock);
+            return 0;
+        }
+        seen = b->generation;
+        pthread_mutex_unlock(&b->lock);
+
+        work(w);
+
+        pthread_mutex_lock(&b->lock);
+        if (--b->running == 0)
+            pthread_cond_signal(&b->finished);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+struct batch *batch_create(u32 n, u32 threads)
+{
+    struct batch *b = calloc(1, sizeof(*b));
+    if (!b)
+        return 0;
+    if (threads < 1)
+        threads = 1;
+    b->n = n;
+    b->threads = threads;
+    b->chunks = (n + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    b->partidas = calloc(n, sizeof(*b->partidas));
+    b->workers = aligned_alloc(64, threads * sizeof(*b->workers));
+    if (!b->partidas || !b->workers) {
+        free(b->partidas);
+        free(b->workers);
+        free(b);
+        return 0;
+    }
+    pthread_mutex_init(&b->lock, 0);
+    pthread_cond_init(&b->start, 0);
+    pthread_cond_init(&b->finished, 0);
+    batch_reset(b);
+
+    for (u32 i = 0; i < threads; i++) {
+        b->workers[i].batch = b;
+        b->workers[i].id = i;
+        atomic_init(&b->workers[i].range, 0);
+    }
+    for (u32 i = 1; i < threads; i++)
+        if (pthread_create(&b->workers[i].thread, 0, worker_main, &b->workers[i])) {
+            b->threads = i;
+            batch_destroy(b);
+            return 0;
+        }
+    return b;
+}
+
+void batch_destroy(struct batch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    b->quit = true;
+    pthread_cond_broadcast(&b->start);
+    pthread_mutex_unlock(&b->lock);
+    for (u32 i = 1; i < b->threads; i++)
+        pthread_join(b->workers[i].thread, 0);
+
+    pthread_cond_destroy(&b->finished);
+    pthread_cond_destroy(&b->start);
+    pthread_mutex_destroy(&b->lock);
+    free(b->workers);
+    free(b->partidas);
+    free(b);
+}
+
+void batch_reset(struct batch *b)
+{
+    for (u32 i = 0; i < b->n; i++)
+        nueva(&b->partidas[i]);
+}
+
+void batch_step(struct batch *b, const u8 *inputs, u8 *cells, s32 *rewards,
+                u8 *done)
+{
+    b->inputs = inputs;
+    b->cells = cells;
+    b->rewards = rewards;
+    b->done = done;
+
+    for (u32 i = 0; i < b->threads; i++) {
+        u64 begin = (u64) b->chunks * i / b->threads;
+        u64 end = (u64) b->chunks * (i + 1) / b->threads;
+        atomic_store(&b->workers[i].range, begin << 32 | end);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->generation++;
+    b->running = b->threads - 1;
+    pthread_cond_broadcast(&b->start);
+    pthread_mutex_unlock(&b->lock);
+
+    work(&b->workers[0]);
+
+    pthread_mutex_lock(&b->lock);
+    while (b->running)
+        pthread_cond_wait(&b->finished, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+u32 batch_size(const struct batch *b)
+{
+    return b->n;
+}
+
+u32 batch_threads(const struct batch *b)
+{
+    return b->threads;
+}
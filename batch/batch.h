@@ -0,0 +1,46 @@
+/* Host-side batched simulation: many independent games (struct juego, see
+ * game.h) stepped in lockstep on a pool of worker threads, for bots and
+ * automated agents that need far more games than one per QEMU VM.
+ *
+ * Each step takes one input per game (INPUT_* bits for the player) and
+ * returns, per game, the cells of the well (enum celda), the reward of the
+ * step and whether the game ended. Games that end are started again right
+ * away, so the returned cells are those of the new game. */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "../game.h"
+
+/* Reward of a step: points scored, minus this much for every life lost. */
+#define BATCH_LIFE_PENALTY (5)
+
+/* Number of game ticks between two periodic updates, as in netplay where a
+ * tick is NET_TICK_MS long. */
+#define BATCH_UPDATE_EVERY (INITIAL_SPEED / NET_TICK_MS)
+
+/* Bytes of cells returned per game by batch_step. */
+#define BATCH_CELLS (WELL_WIDTH * WELL_HEIGHT)
+
+struct batch;
+
+/* Create n games, stepped by threads threads (the caller's included). Return
+ * 0 if out of memory or a thread cannot be started. */
+struct batch *batch_create(u32 n, u32 threads);
+
+void batch_destroy(struct batch *b);
+
+/* Start every game again. */
+void batch_reset(struct batch *b);
+
+/* Advance every game by one tick. inputs holds one byte per game. cells
+ * (BATCH_CELLS bytes per game), rewards and done (one per game) are filled in
+ * if not null. */
+void batch_step(struct batch *b, const u8 *inputs, u8 *cells, s32 *rewards,
+                u8 *done);
+
+/* Number of games and threads of b. */
+u32 batch_size(const struct batch *b);
+u32 batch_threads(const struct batch *b);
+
+#endif
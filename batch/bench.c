@@ -0,0 +1,65 @@
+/* Throughput of the batched simulation: run random inputs through many games
+ * and print simulated game ticks per second.
+ *
+ *     batch_bench [games] [threads] [steps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+static u32 xorshift(u32 *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    u32 n = argc > 1 ? atoi(argv[1]) : 16384;
+    u32 threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    u32 steps = argc > 3 ? atoi(argv[3]) : 1000;
+
+    struct batch *b = batch_create(n, threads);
+    u8 *inputs = malloc(n);
+    u8 *cells = malloc((usize) n * BATCH_CELLS);
+    s32 *rewards = malloc(n * sizeof(*rewards));
+    u8 *done = malloc(n);
+    if (!b || !inputs || !cells || !rewards || !done) {
+        fprintf(stderr, "batch_bench: out of memory\n");
+        return 1;
+    }
+
+    u32 seed = 1;
+    s64 reward = 0;
+    u64 games = 0;
+    double start = now();
+    for (u32 s = 0; s < steps; s++) {
+        for (u32 i = 0; i < n; i++)
+            inputs[i] = xorshift(&seed) & (INPUT_LEFT | INPUT_RIGHT | INPUT_FIRE);
+        batch_step(b, inputs, cells, rewards, done);
+        for (u32 i = 0; i < n; i++) {
+            reward += rewards[i];
+            games += done[i];
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%u games, %u threads, %u steps: %.0f ticks/s (%lld reward, %llu games ended)\n",
+           n, batch_threads(b), steps, (double) n * steps / elapsed,
+           (long long) reward, (unsigned long long) games);
+    batch_destroy(b);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Average the kernel's boot trace over repeated boots under QEMU (make
+# boottime). Each boot with "boottrace" on the command line prints a line like
+#   i386 boot start=1234 main=56 clear=78 frame=910 calibrated=1001112
+# on the debug console, in microseconds since _start (start itself since the
+# processor was reset), and leaves QEMU.
+#
+# Usage: ./boottime.sh [kernel] [boots]
+# QEMU=qemu-system-x86_64 ./boottime.sh main64.elf32 for the x86-64 build.
+
+kernel=${1:-iso/boot/main.elf}
+boots=${2:-10}
+qemu=${QEMU:-qemu-system-i386}
+
+i=0
+while [ "$i" -lt "$boots" ]; do
+    "$qemu" -kernel "$kernel" -append boottrace -display none \
+        -debugcon stdio -device isa-debug-exit,iobase=0xf4,iosize=0x04 \
+        </dev/null
+    i=$((i + 1))
+done | awk '
+$2 == "boot" {
+    n++
+    for (f = 3; f <= NF; f++) {
+        split($f, kv, "=")
+        if (!(kv[1] in sum))
+            order[++stages] = kv[1]
+        sum[kv[1]] += kv[2]
+        if (n == 1 || kv[2] < min[kv[1]])
+            min[kv[1]] = kv[2]
+        if (kv[2] > max[kv[1]])
+            max[kv[1]] = kv[2]
+    }
+}
+END {
+    if (!n) {
+        print "no boot trace seen, did QEMU run?" > "/dev/stderr"
+        exit 1
+    }
+    printf "%d boots, microseconds\n", n
+    printf "%-12s %10s %10s %10s\n", "stage", "average", "min", "max"
+    for (i = 1; i <= stages; i++) {
+        s = order[i]
+        printf "%-12s %10d %10d %10d\n", s, sum[s] / n, min[s], max[s]
+    }
+}'
@@ -3,16 +3,34 @@
 #define TETRIS_VERSION "1.0.0"
 #define TETRIS_URL     "https://github.com/programble/bare-metal-tetris"
 
-/* Tetris well dimensions */
+/* Tetris well dimensions in the 80x25 text mode, and the largest well the
+ * bigger text modes make room for (90x60, see juego_pozo) */
 #define WELL_WIDTH  (22)
 #define WELL_HEIGHT (20)
+#define WELL_MAX_WIDTH  (27)
+#define WELL_MAX_HEIGHT (55)
 
 /* Initial interval in milliseconds at which to apply gravity */
 #define INITIAL_SPEED (200)
 
+/* Length in milliseconds of a display frame: the screen is drawn at most
+ * once per frame, however often the game changes */
+#define FRAME_MS (16)
+
+/* Most ticks run back to back to catch up with the clock before the ones
+ * still due are dropped */
+#define MAX_CATCHUP (5)
+
 /* Delay in milliseconds before rows are cleared */
 #define CLEAR_DELAY (100)
 
+/* Number of the four enemies that steer towards the player instead of falling
+ * straight down */
+#define HOMING_ENEMIES (2)
+
+/* Rate in Hz of the periodic timer interrupt that steps the sound sequencer */
+#define PIT_HZ (1000)
+
 /* Scoring: score is increased by the product of the current level and a factor
  * corresponding to the number of rows cleared. */
 #define SCORE_FACTOR_1 (100)
@@ -29,3 +47,15 @@
 
 /* Number of rows that need to be cleared to increase level */
 #define ROWS_PER_LEVEL (10)
+
+/* Number of games in the high score table, and the disk sector it is kept in.
+ * The sector is only written if it is blank or already holds a table. */
+#define HISCORES (5)
+#define HISCORE_LBA (0)
+
+/* Netplay: length in milliseconds of a simulation tick, number of ticks local
+ * input is delayed by, and number of ticks the simulation may run ahead of the
+ * last confirmed input of the other player before it waits. */
+#define NET_TICK_MS     (20)
+#define NET_INPUT_DELAY (2)
+#define NET_MAX_AHEAD   (8)
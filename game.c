@@ -0,0 +1,857 @@
+/* The game itself: collisions, movement, spawning and the flow field, all on
+ * a struct juego. See game.h. */
+
+#include "game.h"
+
+const u8 TETRIS[6][2][3] = { // 4 enemies of different colors
+    { /* I */ //enemies 1, 2, 3 y 4
+        {6,6,6},
+        {0,6,0}
+    },
+    { /* J */
+        {7,7,7},
+        {0,7,0}
+    },
+    { /* L */
+        {5,5,5},
+        {0,5,0}
+    },
+    { /* O */
+        {1,1,1},
+        {0,1,0}
+    },
+    { /* O */ // for the player
+        {0,3,0},
+        {3,3,3}
+    },
+    { /* O */ // for the second player, in netplay
+        {0,2,0},
+        {2,2,2}
+    }
+};
+
+
+/* Return true if the tetrimino i in rotation r will collide when placed at x,
+ * y. */
+bool collide(const struct juego *j, s8 x, s8 y) // collision with the borders of the screen
+{
+    if (x < 1 || x > (j->ancho - 3) ||  y <= 0 || y >= j->alto) return true;
+    else return false;
+}
+
+bool collide2(const struct juego *j, s8 x, s8 y) // collisions with the walls of the corridor
+{
+    if (x < j->position[1] + 1 || x + 1 > (j->position[1] + 9) ||  y <= 0 || y >= j->alto) return true;
+    else return false;
+}
+
+/* Events */
+
+/* Collisions and movement only detect what happened and queue an event for
+ * it; juego_resolver applies the queued events in one pass. Events are applied
+ * type by type in the order of enum evento_tipo, and in the order they were
+ * queued within a type. An event whose subject is already gone (a bullet or
+ * enemy used up by an earlier hit, a ship that already died this tick) is
+ * dropped, so detecting the same collision twice costs one life, not two. */
+
+/* Queue an event, see enum evento_tipo. */
+void evento(struct juego *j, u8 tipo, u8 a, u8 b)
+{
+    if (j->n_eventos == EVENTOS_MAX) {
+        j->eventos_perdidos++;
+        return;
+    }
+    j->eventos[j->n_eventos++] = (struct evento) {tipo, a, b};
+}
+
+/* Apply e, returning false if it no longer applies. */
+static bool aplicar(struct juego *j, const struct evento *e)
+{
+    struct Nave *nave;
+
+    switch (e->tipo) {
+    case EVENTO_HIT:
+        if (!j->bala[e->a].existe || !j->enemigo[e->b].existe)
+            return false;
+        j->bala[e->a].existe = false;
+        j->enemigo[e->b].existe = false;
+        j->sonidos |= 1 << SOUND_HIT;
+        evento(j, EVENTO_SCORE, j->reglas.puntos_hit, 0);
+        return true;
+    case EVENTO_ROCA:
+        if (!j->rocas[e->a].existe)
+            return false;
+        j->rocas[e->a].existe = false;
+        evento(j, EVENTO_SCORE, j->reglas.puntos_roca, 0);
+        return true;
+    case EVENTO_MUERTE:
+        nave = e->a ? &j->companero : &j->aliado;
+        if (!nave->existe)
+            return false;
+        if (e->b != EVENTO_NADIE && !j->enemigo[e->b].existe)
+            return false;
+        nave->existe = false;
+        if (e->b != EVENTO_NADIE)
+            j->enemigo[e->b].existe = false;
+        if (j->vidas)
+            j->vidas -= 1;
+        j->sonidos |= 1 << SOUND_LIFE;
+        return true;
+    case EVENTO_SCORE:
+        j->score += e->a;
+        return true;
+    }
+    return false;
+}
+
+/* Apply the events queued since the last call and leave the ones that took
+ * effect in aplicados. Applying an event may queue more (scores), which are
+ * applied in the same pass. */
+void juego_resolver(struct juego *j)
+{
+    j->n_aplicados = 0;
+    for (u8 tipo = 0; tipo < EVENTO__LENGTH; tipo++)
+        for (u8 i = 0; i < j->n_eventos; i++)
+            if (j->eventos[i].tipo == tipo && aplicar(j, &j->eventos[i]))
+                j->aplicados[j->n_aplicados++] = j->eventos[i];
+    j->n_eventos = 0;
+}
+
+void check_collisions_nave(struct juego *j, u8 p){ // a player against the enemies
+	struct Nave *nave = p ? &j->companero : &j->aliado;
+	if (!nave->existe) return;
+	for (int xd = 0; xd < 4; xd++){//for de los enemigos
+		if (!j->enemigo[xd].existe) continue;
+		for (int w = 0; w < 2; w++){
+			if ((nave->y + w == j->enemigo[xd].y) || nave->y + w == j->enemigo[xd].y + 1){
+				for (int z = 0; z < 3; z++){
+					if ((nave->x + z == j->enemigo[xd].x) || (nave->x + z == j->enemigo[xd].x + 1) ||(nave->x + z == j->enemigo[xd].x +2)){
+						evento(j, EVENTO_MUERTE, p, xd);
+						return;
+					}
+				}
+			}
+		}
+	}
+}
+
+void check_collisions(struct juego *j){
+	// for bullets againts enemies
+	for (int lyd = 0; lyd < 4; lyd++){//for of bullets
+		if (j->bala[lyd].existe){
+			for (int xd = 0; xd < 4; xd++){//for of the enemies
+				if (!j->enemigo[xd].existe) continue;
+				if ((j->bala[lyd].y == j->enemigo[xd].y) || j->bala[lyd].y == j->enemigo[xd].y + 1){
+					if ((j->bala[lyd].x == j->enemigo[xd].x) || (j->bala[lyd].x == j->enemigo[xd].x + 1) || (j->bala[lyd].x == j->enemigo[xd].x + 2)){
+						evento(j, EVENTO_HIT, lyd, xd);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+
+	// player against enemies
+	check_collisions_nave(j, 0);
+	check_collisions_nave(j, 1);
+}
+
+void check_collisions_pared(struct juego *j){ // player against the corridor, which scrolls into it
+	if (j->aliado.existe && collide2(j, j->aliado.x, j->aliado.y))
+		evento(j, EVENTO_MUERTE, 0, EVENTO_NADIE);
+}
+
+void check_collisions_rocas(struct juego *j){ // check collision rocks
+	if (!j->aliado.existe) return;
+	for (int xd = 0; xd < 3; xd++){
+		if ((j->aliado.y == j->rocas[xd].y)){
+			if (j->aliado.x == j->rocas[xd].x || j->aliado.x + 1 == j->rocas[xd].x || j->aliado.x + 2 == j->rocas[xd].x){
+				evento(j, EVENTO_MUERTE, 0, EVENTO_NADIE);
+				break;
+			}
+		}
+		if (j->aliado.y - 1 == j->rocas[xd].y){
+			if (j->aliado.x + 1 == j->rocas[xd].x){
+				evento(j, EVENTO_MUERTE, 0, EVENTO_NADIE);
+				break;
+			}
+		}
+	}
+}
+
+void check_game_over(struct juego *j){
+	if (j->vidas == 0){
+		j->game_over = true;
+	}
+}
+
+void check_level_change(struct juego *j){
+	if (j->score >= j->reglas.puntos_nivel2){
+		if (!j->level2)
+			j->sonidos |= 1 << SOUND_LEVEL;
+		j->level2 = true;
+		j->level = 2;
+	}
+}
+
+void inicializar(struct juego *j) // to create player, enemies and bullets for level 1
+{
+
+	j->aliado.i = 4;
+	j->aliado.y = j->alto - 2;
+	j->aliado.x = (j->ancho/2); //WELL_WIDTH/2) - 8
+	j->aliado.existe = false;
+
+	j->companero.existe = false;
+
+	for (int lyd = 0; lyd < 4; lyd++){
+	    j->enemigo[lyd].i = lyd;
+	    j->enemigo[lyd].x = (lyd*5) + 1; // define a random position
+	    j->enemigo[lyd].y = 4; // initial position in y
+	    j->enemigo[lyd].existe = false;
+		
+	}
+
+	for (int lyd = 0; lyd < 4; lyd++){ // to create the bullets
+	    j->bala[lyd].x = 10; // just to give a number, it will be defined as the players position
+	    j->bala[lyd].y = j->alto - 3; // initial position in y
+	    j->bala[lyd].existe = false;  
+	}
+}
+
+void inicializar2(struct juego *j) // this is to create player and rocks, for level 2
+{
+
+	j->aliado.i = 4;
+	j->aliado.y = j->alto - 2;
+	j->aliado.x = (j->position[1]) + 4; //WELL_WIDTH/2) - 8
+	j->aliado.existe = false;
+
+	/* The corridor zigzags from the left to 10 cells right and back every 20
+	 * rows, in the middle of a well wider than the 80x25 one. */
+	u32 hola, margen = (j->ancho - WELL_WIDTH) / 2;
+
+	for (hola = 0; hola < j->alto; hola++){
+		u32 fase = hola % 20;
+		j->position[hola] = margen + (fase < 11 ? fase : 20 - fase);
+	}
+
+	j->rocas[0].x = j->position[17] + 2; 
+	j->rocas[0].y = 2; 
+	j->rocas[0].existe = true; 
+
+	j->rocas[1].x = j->position[14] + 7; 
+	j->rocas[1].y = 5; 
+	j->rocas[1].existe = true; 
+
+	j->rocas[2].x = j->position[4] + 9; 
+	j->rocas[2].y = 15; 
+	j->rocas[2].existe = true; 
+}
+
+void spawn(struct juego *j) // If does not exist, create it
+{
+	if (j->aliado.existe == false){
+		j->aliado.y = j->alto - 2;
+		j->aliado.x = (j->ancho/2) - 1; //WELL_WIDTH/2) - 8
+		j->aliado.existe = true;
+	}
+
+	if (j->dos_jugadores && j->companero.existe == false){
+		j->companero.i = 5;
+		j->companero.y = j->alto - 2;
+		j->companero.x = (j->ancho/2) - 6;
+		j->companero.existe = true;
+	}
+
+	if (j->updates % j->reglas.spawn_cada)
+		return;
+	for (u32 lyd = 0; lyd < j->reglas.enemigos; lyd++){
+	    if (j->enemigo[lyd].existe == false){
+	    	j->enemigo[lyd].x = (lyd*5) + 1; // define la posicion con un random
+	    	j->enemigo[lyd].y = 4; // posicion inicial en y
+		    j->enemigo[lyd].existe = true;
+		    return;
+		}
+	}
+}
+
+void spawn2(struct juego *j) // If does not exist, create it
+{
+	if (j->aliado.existe == false){
+		j->aliado.y = j->alto - 2;
+		j->aliado.x = (j->position[1]) + 4; //WELL_WIDTH/2) - 8
+		j->aliado.existe = true;
+	}
+
+	for (int lyd = 0; lyd < 3; lyd++){
+		if (j->rocas[lyd].existe == false){
+	    	j->rocas[lyd].y = 0; // posicion inicial en y
+	    	j->rocas[lyd].existe = true; // estaba en false
+		}
+	}
+}
+
+
+/* Try to move the enemigo[lyd] tetrimino by dx, dy and return true if successful.
+ */
+bool move_nave(struct juego *j, struct Nave *nave, s8 dx, s8 dy) // to move a player
+{
+	if(!(nave->existe)) return false; // if does not exist, no need to do anything
+    if (collide(j, nave->x + dx, nave->y + dy))
+        return false;
+    nave->x += dx;
+    nave->y += dy;
+    return true;
+}
+
+bool move_bichito(struct juego *j, s8 dx, s8 dy) // to move player
+{
+    return move_nave(j, &j->aliado, dx, dy);
+}
+
+bool move_bichito2(struct juego *j, s8 dx, s8 dy) // to move player level 2
+{
+	if(!(j->aliado.existe)) return false; // if does not exist, no need to do anything
+    if (collide2(j, j->aliado.x + dx, j->aliado.y + dy)){
+        evento(j, EVENTO_MUERTE, 0, EVENTO_NADIE);
+        return false;
+    }
+    j->aliado.x += dx;
+    j->aliado.y += dy;
+    return true;
+}
+
+bool move_enemigo(struct juego *j, s8 dx, s8 dy, s8 lol) // for enemies
+{
+    if(!(j->enemigo[lol].existe)) return false; // if does not exist, no need to do anything
+    if (collide(j, j->enemigo[lol].x + dx, j->enemigo[lol].y + dy))
+        return false;
+    j->enemigo[lol].x += dx;
+    j->enemigo[lol].y += dy;
+    return true;
+}
+
+bool move_bala(struct juego *j, s8 dx, s8 dy, s8 lol) // for bullets
+{
+    if((j->bala[lol].existe)== false) return false; // if does not exist, no need to do anything
+    if (collide(j, j->bala[lol].x + dx, j->bala[lol].y + dy))
+        return false;
+    j->bala[lol].x += dx;
+    j->bala[lol].y += dy;
+    return true;
+}
+
+bool move_rocas(struct juego *j, s8 dx, s8 dy, s8 lol) // for rocks
+{
+    if((j->rocas[lol].existe)== false) return false; // if does not exist, no need to do anything
+    if (collide(j, j->rocas[lol].x + dx, j->rocas[lol].y + dy))
+        return false;
+    j->rocas[lol].x += dx;
+    j->rocas[lol].y += dy;
+    return true;
+}
+
+/* Flow Field */
+
+/* Homing enemies steer by a flow field over the well instead of searching for
+ * the player one by one. For every cell the field holds the distance to the
+ * nearest cell where an enemy touches a player, and the direction to move to
+ * get closer, so the pathing cost does not depend on the number of enemies.
+ * Cells are enemy positions (the top left of the 3x2 shape) and enemies only
+ * move down, left or right, so the field is built backwards from the goals
+ * along those moves. The field is rebuilt when a player moves; obstacles that
+ * come and go otherwise (rocks, and the walls of the level 2 corridor as it
+ * scrolls) are patched in place, touching only the cells whose distance
+ * changes. With no homing enemy about there is no field to keep. */
+
+/* The cell reached from cell by moving in dir, or -1 if it is off the grid. */
+s16 field_next(const struct juego *j, u16 cell, u8 dir)
+{
+    u8 x = cell % j->ancho;
+    switch (dir) {
+    case FIELD_DOWN:  return cell + j->ancho < j->ancho * j->alto ? cell + j->ancho : -1;
+    case FIELD_LEFT:  return x > 0 ? cell - 1 : -1;
+    case FIELD_RIGHT: return x < j->ancho - 1 ? cell + 1 : -1;
+    }
+    return -1;
+}
+
+/* The move that takes the cell entered from cell to cell, i.e. the reverse of
+ * dir. Used to walk the field backwards. */
+u8 field_reverse(u8 dir)
+{
+    return dir == FIELD_LEFT ? FIELD_RIGHT : dir == FIELD_RIGHT ? FIELD_LEFT : 0;
+}
+
+void field_push(struct juego *j, u16 cell)
+{
+    if (j->campo->queued[cell])
+        return;
+    j->campo->queued[cell] = true;
+    j->campo->queue[j->campo->tail] = cell;
+    j->campo->tail = (j->campo->tail + 1) % FIELD_CELLS;
+}
+
+/* Propagate the distances of the queued cells to the cells that move into
+ * them, until nothing improves. Among equally short moves the first of down,
+ * left, right is taken, so the field does not depend on the order in which
+ * cells were patched. */
+void field_relax(struct juego *j)
+{
+    while (j->campo->head != j->campo->tail) {
+        u16 cell = j->campo->queue[j->campo->head];
+        j->campo->head = (j->campo->head + 1) % FIELD_CELLS;
+        j->campo->queued[cell] = false;
+
+        for (u8 dir = FIELD_DOWN; dir <= FIELD_RIGHT; dir++) {
+            /* the cell that reaches this one by moving in dir */
+            s16 from;
+            if (dir == FIELD_DOWN)
+                from = cell >= j->ancho ? cell - j->ancho : -1;
+            else
+                from = field_next(j, cell, field_reverse(dir));
+            if (from < 0 || j->campo->blocked[from] || j->campo->dir[from] == FIELD_GOAL)
+                continue;
+            u16 dist = j->campo->dist[cell] + 1;
+            if (dist < j->campo->dist[from] ||
+                (dist == j->campo->dist[from] && dir < j->campo->dir[from])) {
+                j->campo->dist[from] = dist;
+                j->campo->dir[from] = dir;
+                field_push(j, from);
+            }
+        }
+    }
+}
+
+/* Set the distance and direction of cell from its neighbours, as far as they
+ * are known. */
+void field_settle(struct juego *j, u16 cell)
+{
+    j->campo->dist[cell] = FIELD_FAR;
+    j->campo->dir[cell] = FIELD_NONE;
+    for (u8 dir = FIELD_DOWN; dir <= FIELD_RIGHT; dir++) {
+        s16 next = field_next(j, cell, dir);
+        if (next < 0 || j->campo->blocked[next] || j->campo->dist[next] == FIELD_FAR)
+            continue;
+        if (j->campo->dist[next] + 1 < j->campo->dist[cell]) {
+            j->campo->dist[cell] = j->campo->dist[next] + 1;
+            j->campo->dir[cell] = dir;
+        }
+    }
+}
+
+/* An obstacle now covers cell: forget every distance that was routed through
+ * it and recompute those cells from the unaffected ones around them. */
+void field_block(struct juego *j, u16 cell)
+{
+    if (j->campo->dist[cell] == FIELD_FAR)
+        return;
+
+    /* Cells whose path leads through cell, found by walking the field
+     * backwards. campo->queue doubles as the list of them. */
+    u16 n = 0;
+    j->campo->dist[cell] = FIELD_FAR;
+    j->campo->dir[cell] = FIELD_NONE;
+    j->campo->queue[n++] = cell;
+    for (u16 i = 0; i < n; i++)
+        for (u8 dir = FIELD_DOWN; dir <= FIELD_RIGHT; dir++) {
+            s16 from;
+            if (dir == FIELD_DOWN)
+                from = j->campo->queue[i] >= j->ancho ? j->campo->queue[i] - j->ancho : -1;
+            else
+                from = field_next(j, j->campo->queue[i], field_reverse(dir));
+            if (from < 0 || j->campo->dir[from] != dir || j->campo->dist[from] == FIELD_FAR)
+                continue;
+            j->campo->dist[from] = FIELD_FAR;
+            j->campo->dir[from] = FIELD_NONE;
+            j->campo->queue[n++] = from;
+        }
+
+    /* Queue the ones the unaffected cells reach again. The queue is refilled
+     * from its start as the list is read, never past the entry being read,
+     * since each entry queues at most one cell. */
+    j->campo->head = j->campo->tail = 0;
+    for (u16 i = 1; i < n; i++) {
+        u16 lost = j->campo->queue[i];
+        field_settle(j, lost);
+        if (j->campo->dist[lost] != FIELD_FAR)
+            field_push(j, lost);
+    }
+    field_relax(j);
+}
+
+/* Return true if an enemy at cell would touch a player the field was built
+ * for, see field_build. */
+bool field_goal(const struct juego *j, u16 cell)
+{
+    s8 x = cell % j->ancho, y = cell / j->ancho;
+    for (u8 p = 0; p < 2; p++)
+        if (j->campo->goal[p][0] >= 0 &&
+            x >= j->campo->goal[p][0] - 2 && x <= j->campo->goal[p][0] + 2 &&
+            y >= j->campo->goal[p][1] - 1 && y <= j->campo->goal[p][1] + 1)
+            return true;
+    return false;
+}
+
+/* The obstacle covering cell is gone: give it a distance from its neighbours
+ * and spread any improvement. */
+void field_unblock(struct juego *j, u16 cell)
+{
+    if (field_goal(j, cell)) {
+        j->campo->dist[cell] = 0;
+        j->campo->dir[cell] = FIELD_GOAL;
+    } else
+        field_settle(j, cell);
+    if (j->campo->dist[cell] != FIELD_FAR) {
+        field_push(j, cell);
+        field_relax(j);
+    }
+}
+
+/* Add (delta 1) or remove (delta -1) an obstacle at x, y: block every cell
+ * from which an enemy would overlap it. Patch the field if valid is set. */
+void field_obstacle(struct juego *j, s8 x, s8 y, s8 delta, bool patch)
+{
+    for (s8 yy = y - 1; yy <= y; yy++)
+        for (s8 xx = x - 2; xx <= x; xx++) {
+            if (xx < 0 || xx >= j->ancho || yy < 0 || yy >= j->alto)
+                continue;
+            u16 cell = yy * j->ancho + xx;
+            j->campo->blocked[cell] += delta;
+            if (!patch)
+                continue;
+            if (delta > 0 && j->campo->blocked[cell] == 1)
+                field_block(j, cell);
+            else if (delta < 0 && j->campo->blocked[cell] == 0)
+                field_unblock(j, cell);
+        }
+}
+
+/* Rebuild the field from scratch: obstacles first, then a breadth-first
+ * search from the cells where an enemy touches a player. */
+void field_build(struct juego *j)
+{
+    u16 cell;
+    for (cell = 0; cell < j->ancho * j->alto; cell++) {
+        s8 x = cell % j->ancho, y = cell / j->ancho;
+        j->campo->blocked[cell] = collide(j, x, y);
+        j->campo->dist[cell] = FIELD_FAR;
+        j->campo->dir[cell] = FIELD_NONE;
+        j->campo->queued[cell] = false;
+    }
+
+    if (j->level2) {
+        /* corridor walls, as drawn by draw2 */
+        for (u8 i = 0; i < j->alto - 1; i++) {
+            field_obstacle(j, j->position[i], j->alto - i, 1, false);
+            field_obstacle(j, j->position[i] + 11, j->alto - i, 1, false);
+        }
+        for (u8 i = 0; i < 3; i++)
+            if (j->rocas[i].existe)
+                field_obstacle(j, j->rocas[i].x, j->rocas[i].y, 1, false);
+    }
+    for (u8 i = 0; i < 3; i++)
+        j->campo->rocas[i] = j->rocas[i];
+    for (u8 i = 0; i < j->alto; i++)
+        j->campo->position[i] = j->position[i];
+    j->campo->level2 = j->level2;
+
+    j->campo->head = j->campo->tail = 0;
+    for (u8 p = 0; p < 2; p++) {
+        struct Nave *nave = p ? &j->companero : &j->aliado;
+        j->campo->goal[p][0] = nave->existe ? nave->x : -1;
+        j->campo->goal[p][1] = nave->y;
+        if (!nave->existe)
+            continue;
+        /* enemy positions that overlap the ship, see check_collisions */
+        for (s8 y = nave->y - 1; y <= nave->y + 1; y++)
+            for (s8 x = nave->x - 2; x <= nave->x + 2; x++) {
+                if (x < 0 || x >= j->ancho || y < 0 || y >= j->alto)
+                    continue;
+                cell = y * j->ancho + x;
+                if (j->campo->blocked[cell])
+                    continue;
+                j->campo->dist[cell] = 0;
+                j->campo->dir[cell] = FIELD_GOAL;
+                field_push(j, cell);
+            }
+    }
+    field_relax(j);
+    j->campo->valid = true;
+}
+
+/* Bring the field up to date with the players and obstacles. Cheap when
+ * nothing changed. */
+void field_update(struct juego *j)
+{
+    bool homing = false;
+    for (u8 i = 0; i < HOMING_ENEMIES; i++)
+        if (j->enemigo[i].existe)
+            homing = true;
+    if (!homing) {
+        j->campo->valid = false; /* nothing kept it up to date meanwhile */
+        return;
+    }
+
+    if (j->campo->level2 != j->level2)
+        j->campo->valid = false;
+    for (u8 p = 0; p < 2 && j->campo->valid; p++) {
+        struct Nave *nave = p ? &j->companero : &j->aliado;
+        s8 x = nave->existe ? nave->x : -1;
+        if (x != j->campo->goal[p][0] || (x >= 0 && nave->y != j->campo->goal[p][1]))
+            j->campo->valid = false;
+    }
+    if (!j->campo->valid) {
+        field_build(j);
+        return;
+    }
+    if (!j->level2)
+        return;
+
+    /* The corridor scrolled: move the walls of every row that changed. New
+     * walls go in before the old ones come out, so the cells both cover
+     * stay blocked and only the edges are patched. */
+    for (u8 i = 0; i < j->alto - 1; i++)
+        if (j->campo->position[i] != j->position[i]) {
+            field_obstacle(j, j->position[i], j->alto - i, 1, true);
+            field_obstacle(j, j->position[i] + 11, j->alto - i, 1, true);
+        }
+    for (u8 i = 0; i < j->alto - 1; i++)
+        if (j->campo->position[i] != j->position[i]) {
+            field_obstacle(j, j->campo->position[i], j->alto - i, -1, true);
+            field_obstacle(j, j->campo->position[i] + 11, j->alto - i, -1, true);
+        }
+    for (u8 i = 0; i < j->alto; i++)
+        j->campo->position[i] = j->position[i];
+
+    for (u8 i = 0; i < 3; i++) {
+        struct Bala *was = &j->campo->rocas[i], *now = &j->rocas[i];
+        if (was->existe == now->existe && was->x == now->x && was->y == now->y)
+            continue;
+        if (now->existe)
+            field_obstacle(j, now->x, now->y, 1, true);
+        if (was->existe)
+            field_obstacle(j, was->x, was->y, -1, true);
+        *was = *now;
+    }
+}
+
+/* Return the direction an enemy at x, y should move in. */
+u8 field_step(struct juego *j, s8 x, s8 y)
+{
+    if (x < 0 || x >= j->ancho || y < 0 || y >= j->alto)
+        return FIELD_NONE;
+    return j->campo->dir[y * j->ancho + x];
+}
+
+/* Move enemy lyd one step: homing enemies follow the flow field, the others
+ * (and homing ones with no way to a player) fall straight down. Return false
+ * if it left the well. */
+bool move_enemigo_campo(struct juego *j, s8 lyd)
+{
+    if (lyd < HOMING_ENEMIES && j->enemigo[lyd].existe)
+        switch (field_step(j, j->enemigo[lyd].x, j->enemigo[lyd].y)) {
+        case FIELD_LEFT:
+            move_enemigo(j, -1, 0, lyd);
+            return true;
+        case FIELD_RIGHT:
+            move_enemigo(j, 1, 0, lyd);
+            return true;
+        }
+    return move_enemigo(j, 0, 1, lyd);
+}
+
+/* Update the game state. Called at an interval relative to the enemigo[lyd] level.
+ */
+void update(struct juego *j)
+{
+	j->updates++;
+	field_update(j);
+	for (int lyd = 0; lyd < 4; lyd++){
+	    if (!(move_enemigo_campo(j, lyd))) j->enemigo[lyd].existe = false;
+	    if (!(move_bala(j, 0, -1, lyd))) j->bala[lyd].existe = false; 
+	}
+	spawn(j);
+}
+
+void update2(struct juego *j) // update for level 2
+{
+	j->updates++;
+	field_update(j);
+	for (int lyd = 0; lyd < 4; lyd++){
+	    if (!(move_enemigo_campo(j, lyd))) j->enemigo[lyd].existe = false; 
+	}
+	for (int lyd = 0; lyd < 3; lyd++){
+		if (!(move_rocas(j, 0, 1, lyd)))
+			evento(j, EVENTO_ROCA, lyd, 0);
+	}
+	u32 temp_position = j->position[0];
+
+	for (int lyd = 0; lyd < j->alto - 1; lyd++){
+		j->position[lyd] = j->position[lyd+1];
+	}
+	j->position[j->alto - 1] = temp_position;
+
+	spawn2(j);
+}
+
+void disparar_desde(struct juego *j, struct Nave *nave){ // to shoot the bullets from a player
+	for (int lyd = 0; lyd < 4; lyd++){
+		if (j->bala[lyd].existe == false){
+			j->bala[lyd].existe = true;
+			j->bala[lyd].x = nave->x + 1; // create it in front of the player position
+			j->bala[lyd].y = nave->y - 1;
+			j->sonidos |= 1 << SOUND_SHOT;
+			return;
+		}
+	}
+}
+
+void disparar(struct juego *j){ // to shoot the bullets
+	disparar_desde(j, &j->aliado);
+}
+
+/* Set the size of the well in cells, within the default and the largest one.
+ * Takes effect on the next juego_nuevo. Both sides of a netplay game must use
+ * the same size. */
+void juego_pozo(struct juego *j, u8 ancho, u8 alto)
+{
+    j->ancho = ancho < WELL_WIDTH ? WELL_WIDTH : ancho > WELL_MAX_WIDTH ? WELL_MAX_WIDTH : ancho;
+    j->alto = alto < WELL_HEIGHT ? WELL_HEIGHT : alto > WELL_MAX_HEIGHT ? WELL_MAX_HEIGHT : alto;
+}
+
+/* Set the rules to the defaults. */
+void juego_reglas(struct juego *j)
+{
+    j->reglas = (struct reglas) {
+        .puntos_nivel2 = 20,
+        .puntos_fin = 35,
+        .vidas = 3,
+        .puntos_hit = 1,
+        .puntos_roca = 1,
+        .enemigos = 4,
+        .spawn_cada = 1,
+    };
+}
+
+/* Start a new game at level 1, keeping dos_jugadores, the size of the well and
+ * the rules (the defaults if they were never set). */
+void juego_nuevo(struct juego *j)
+{
+    if (!j->ancho)
+        juego_pozo(j, WELL_WIDTH, WELL_HEIGHT);
+    if (!j->reglas.spawn_cada)
+        juego_reglas(j);
+    j->score = 0;
+    j->level = 1;
+    j->vidas = j->reglas.vidas;
+    j->game_over = false;
+    j->level2 = false;
+    j->pos = 0;
+    j->tick = 0;
+    j->updates = 0;
+    j->sonidos = 0;
+    j->campo->valid = false;
+    j->n_eventos = 0;
+    j->n_aplicados = 0;
+    inicializar(j);
+}
+
+/* Go back to copia, a copy of j taken earlier, keeping j's flow field. It
+ * no longer matches the game and is rebuilt on the next update. */
+void juego_restaurar(struct juego *j, const struct juego *copia)
+{
+    struct campo *campo = j->campo;
+    *j = *copia;
+    j->campo = campo;
+    campo->valid = false;
+}
+
+/* Apply one tick of input to a player's ship in level 1. */
+void juego_input(struct juego *j, struct Nave *nave, u8 input)
+{
+    if (input & INPUT_LEFT)
+        move_nave(j, nave, -1, 0);
+    if (input & INPUT_RIGHT)
+        move_nave(j, nave, 1, 0);
+    if (input & INPUT_FIRE)
+        disparar_desde(j, nave);
+}
+
+/* Advance the game by one tick with the input of each player, running the
+ * periodic update every update_every ticks. The game only depends on its
+ * state and the inputs, so two games fed the same inputs stay identical. */
+void juego_tick(struct juego *j, u8 input0, u8 input1, u32 update_every)
+{
+    if (j->level2) {
+        if (input0 & INPUT_LEFT)
+            move_bichito2(j, -1, 0);
+        if (input0 & INPUT_RIGHT)
+            move_bichito2(j, 1, 0);
+    } else {
+        juego_input(j, &j->aliado, input0);
+        juego_input(j, &j->companero, input1);
+    }
+
+    if (++j->tick % update_every == 0) {
+        if (j->level2)
+            update2(j);
+        else
+            update(j);
+        j->pos = (j->pos + 1) % 4;
+    }
+
+    if (j->level2) {
+        check_collisions_pared(j);
+        check_collisions_rocas(j);
+    } else
+        check_collisions(j);
+    juego_resolver(j);
+    check_game_over(j);
+}
+
+/* Mark the cells of the TETRIS shape i at x, y in cells. */
+static void observar_forma(u8 cells[WELL_HEIGHT][WELL_WIDTH], u8 i, s8 x, s8 y,
+                           u8 celda)
+{
+    for (s8 yy = 0; yy < 2; yy++)
+        for (s8 xx = 0; xx < 3; xx++)
+            if (TETRIS[i][yy][xx] && y + yy >= 0 && y + yy < WELL_HEIGHT &&
+                x + xx >= 0 && x + xx < WELL_WIDTH)
+                cells[y + yy][x + xx] = celda;
+}
+
+/* Fill cells with what is in each cell of the well, as enum celda. Only for
+ * wells of the default size. */
+void juego_observar(const struct juego *j, u8 cells[WELL_HEIGHT][WELL_WIDTH])
+{
+    for (u8 y = 0; y < WELL_HEIGHT; y++)
+        for (u8 x = 0; x < WELL_WIDTH; x++)
+            cells[y][x] = CELDA_VACIA;
+
+    if (j->level2) {
+        /* corridor walls, as drawn by draw2 */
+        for (u8 i = 1; i < 19; i++) {
+            cells[WELL_HEIGHT - i][j->position[i]] = CELDA_PARED;
+            if (j->position[i] + 11 < WELL_WIDTH)
+                cells[WELL_HEIGHT - i][j->position[i] + 11] = CELDA_PARED;
+        }
+        for (u8 i = 0; i < 3; i++)
+            if (j->rocas[i].existe && j->rocas[i].y >= 0 && j->rocas[i].y < WELL_HEIGHT)
+                cells[j->rocas[i].y][j->rocas[i].x] = CELDA_ROCA;
+    }
+    for (u8 i = 0; i < 4; i++) {
+        if (j->enemigo[i].existe)
+            observar_forma(cells, j->enemigo[i].i, j->enemigo[i].x, j->enemigo[i].y,
+                           CELDA_ENEMIGO);
+        if (j->bala[i].existe && j->bala[i].y >= 0 && j->bala[i].y < WELL_HEIGHT)
+            cells[j->bala[i].y][j->bala[i].x] = CELDA_BALA;
+    }
+    if (j->aliado.existe)
+        observar_forma(cells, j->aliado.i, j->aliado.x, j->aliado.y, CELDA_ALIADO);
+    if (j->companero.existe)
+        observar_forma(cells, j->companero.i, j->companero.x, j->companero.y,
+                       CELDA_COMPANERO);
+}
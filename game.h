@@ -0,0 +1,175 @@
+/* Game state and simulation. Everything a game needs lives in one struct
+ * juego, so the kernel can snapshot it for netplay and the host-side batch
+ * simulator (batch/) can run many games side by side. Nothing in here touches
+ * hardware. */
+
+#ifndef GAME_H
+#define GAME_H
+
+#include "types.h"
+#include "config.h"
+
+/* Shapes and colors: 4 enemies, the player and the second player */
+extern const u8 TETRIS[6][2][3];
+
+struct Nave{
+    u8 i; // Index for este color
+    s8 x, y; // position
+    bool existe;    // to know if exists or not
+};
+
+struct Bala{
+	s8 x,y; // position
+	bool existe; // to know if exists, 0 -> does not exists
+};
+
+/* Sound effects the game asks for, see sonidos in struct juego. */
+enum sound {
+    SOUND_SHOT,
+    SOUND_HIT,
+    SOUND_LIFE,
+    SOUND_LEVEL,
+    SOUND__LENGTH
+};
+
+/* Things that happen to the game, queued by collisions and movement and
+ * applied by juego_resolver in this order. a and b say to what:
+ * EVENTO_HIT       bullet a hit enemy b
+ * EVENTO_ROCA      rock a got past the bottom of the well
+ * EVENTO_MUERTE    player a (0 aliado, 1 companero) was hit, by enemy b or
+ *                  by a wall or rock if b is EVENTO_NADIE
+ * EVENTO_SCORE     a points scored */
+enum evento_tipo {
+    EVENTO_HIT,
+    EVENTO_ROCA,
+    EVENTO_MUERTE,
+    EVENTO_SCORE,
+    EVENTO__LENGTH
+};
+
+#define EVENTO_NADIE (0xFF)
+#define EVENTOS_MAX  (32)
+
+struct evento {
+    u8 tipo, a, b;
+};
+
+/* Rules of a game that can be changed while it runs (the kernel's tunables
+ * console sets them), see juego_reglas for the defaults. They are part of
+ * struct juego so netplay snapshots and the batch simulator carry them. */
+struct reglas {
+    u32 puntos_nivel2;  // score that moves the game to level 2
+    u32 puntos_fin;     // score that wins level 2
+    u32 vidas;          // lives at the start of a game
+    u32 puntos_hit;     // for shooting an enemy
+    u32 puntos_roca;    // for a rock getting past the bottom
+    u32 enemigos;       // most enemies at once, up to 4
+    u32 spawn_cada;     // updates between enemy spawns
+};
+
+/* Input of a player for one tick of juego_tick. */
+#define INPUT_LEFT  (1 << 0)
+#define INPUT_RIGHT (1 << 1)
+#define INPUT_FIRE  (1 << 2)
+
+/* Directions in the flow field homing enemies follow, see game.c. */
+enum field_dir {
+    FIELD_NONE, /* no way to reach a player from here */
+    FIELD_GOAL, /* touching a player */
+    FIELD_DOWN,
+    FIELD_LEFT,
+    FIELD_RIGHT
+};
+
+#define FIELD_CELLS (WELL_MAX_WIDTH * WELL_MAX_HEIGHT)
+#define FIELD_FAR   (0xFFFF)
+
+/* The flow field and the scratch space that builds it. Everything in it can
+ * be worked out again from the rest of the game, so it is not part of struct
+ * juego: a game points to one, and copying a game (netplay snapshots) copies
+ * only the pointer. See juego_restaurar. */
+struct campo {
+    u8 dir[FIELD_CELLS];
+    u16 dist[FIELD_CELLS];
+    u8 blocked[FIELD_CELLS];  /* number of obstacles covering the cell */
+    u8 queued[FIELD_CELLS];
+    u16 queue[FIELD_CELLS];
+    u16 head, tail;
+
+    bool valid;               /* false to rebuild on the next update */
+    s8 goal[2][2];            /* x, y of each player when built, -1 if absent */
+    struct Bala rocas[3];     /* rocks as applied to blocked */
+    u32 position[WELL_MAX_HEIGHT]; /* corridor as applied to blocked */
+    bool level2;              /* built for level 2 */
+};
+
+struct juego {
+    struct Nave aliado;     // player
+    struct Nave companero;  // second player, only exists with dos_jugadores
+    struct Nave enemigo[4]; // enemies
+    struct Bala bala[4];    // bullets
+    struct Bala rocas[3];   // rocks, for level 2
+    u32 position[WELL_MAX_HEIGHT]; // corridor, one entry per row, for level 2
+    u8 ancho, alto;         // size of the well, see juego_pozo
+    struct reglas reglas;
+
+    u32 score, level, vidas;
+    bool game_over, level2;
+    bool dos_jugadores;     // companero is played too (netplay)
+
+    int pos;                // phase of the moving walls, 0 to 3
+    u32 tick;               // number of calls to juego_tick
+    u32 updates;            // number of calls to update and update2
+    u8 sonidos;             // one bit per enum sound asked for since cleared
+
+    struct campo *campo;    // flow field for the homing enemies, never 0
+
+    struct evento eventos[EVENTOS_MAX];   // queued since the last juego_resolver
+    u8 n_eventos;
+    struct evento aplicados[EVENTOS_MAX]; // applied by the last juego_resolver
+    u8 n_aplicados;
+    u32 eventos_perdidos;   // events dropped because the queue was full
+};
+
+/* Kinds of cell in the grid filled by juego_observar. */
+enum celda {
+    CELDA_VACIA,
+    CELDA_ALIADO,
+    CELDA_COMPANERO,
+    CELDA_ENEMIGO,
+    CELDA_BALA,
+    CELDA_ROCA,
+    CELDA_PARED
+};
+
+bool collide(const struct juego *j, s8 x, s8 y);
+bool collide2(const struct juego *j, s8 x, s8 y);
+void evento(struct juego *j, u8 tipo, u8 a, u8 b);
+void juego_resolver(struct juego *j);
+void check_collisions(struct juego *j);
+void check_collisions_pared(struct juego *j);
+void check_collisions_rocas(struct juego *j);
+void check_game_over(struct juego *j);
+void check_level_change(struct juego *j);
+void inicializar(struct juego *j);
+void inicializar2(struct juego *j);
+void spawn(struct juego *j);
+void spawn2(struct juego *j);
+bool move_nave(struct juego *j, struct Nave *nave, s8 dx, s8 dy);
+bool move_bichito(struct juego *j, s8 dx, s8 dy);
+bool move_bichito2(struct juego *j, s8 dx, s8 dy);
+void update(struct juego *j);
+void update2(struct juego *j);
+void disparar_desde(struct juego *j, struct Nave *nave);
+void disparar(struct juego *j);
+void field_update(struct juego *j);
+
+void juego_pozo(struct juego *j, u8 ancho, u8 alto);
+void juego_reglas(struct juego *j);
+void juego_nuevo(struct juego *j);
+void juego_restaurar(struct juego *j, const struct juego *copia);
+void juego_input(struct juego *j, struct Nave *nave, u8 input);
+void juego_tick(struct juego *j, u8 input0, u8 input1, u32 update_every);
+void juego_observar(const struct juego *j, u8 cells[WELL_HEIGHT][WELL_WIDTH]);
+
+#endif
@@ -1,21 +1,10 @@
-#include "config.h"
+#include <stdarg.h>
 
-typedef unsigned char      u8;
-typedef signed   char      s8;
-typedef unsigned short     u16;
-typedef signed   short     s16;
-typedef unsigned int       u32;
-typedef signed   int       s32;
-typedef unsigned long long u64;
-typedef signed   long long s64;
+#include "types.h"
+#include "game.h"
 
 #define noreturn __attribute__((noreturn)) void
 
-typedef enum bool {
-    false,
-    true
-} bool;
-
 /* Simple math */
 
 /* A very simple and stupid exponentiation algorithm */
@@ -27,6 +16,145 @@ static inline double pow(double a, double b)
     return result;
 }
 
+/* n / d, for the few 64-bit divisions that cannot be shifts: the i386 build
+ * has no instruction for them. Bit by bit, so not for hot paths. */
+u64 div64(u64 n, u32 d)
+{
+    u64 q = 0, r = 0;
+    for (s8 i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= 1ull << i;
+        }
+    }
+    return q;
+}
+
+/* Memory */
+
+/* GCC may emit calls to these for struct assignment and initialization, even
+ * when freestanding. */
+void *memcpy(void *dst, const void *src, usize n)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+    while (n--)
+        *d++ = *s++;
+    return dst;
+}
+
+void *memset(void *dst, int c, usize n)
+{
+    u8 *d = dst;
+    while (n--)
+        *d++ = c;
+    return dst;
+}
+
+/* Vector Kernels */
+
+/* Fill, copy and compare runs of 16-bit text mode cells. Each has a scalar
+ * version and an SSE2 version that handles 8 cells per instruction;
+ * vector_init picks one through the function pointers below. The SSE2 code is
+ * compiled with a target attribute, so the rest of the i386 kernel does not
+ * need SSE and the scalar versions still run on processors without it. */
+
+typedef u16 v8u16 __attribute__((vector_size(16), may_alias, aligned(1)));
+typedef s16 v8s16 __attribute__((vector_size(16)));
+typedef char v16s8 __attribute__((vector_size(16)));
+
+void fill16_scalar(u16 *dst, u16 value, usize n)
+{
+    while (n--)
+        *dst++ = value;
+}
+
+void copy16_scalar(u16 *dst, const u16 *src, usize n)
+{
+    while (n--)
+        *dst++ = *src++;
+}
+
+/* Set bit i % 8 of mask[i / 8] if a[i] != b[i] and clear it otherwise, for
+ * the n cells of a and b. Return true if any cell differs. */
+bool diff16_scalar(const u16 *a, const u16 *b, usize n, u8 *mask)
+{
+    u8 any = 0;
+    for (usize i = 0; i < n; i += 8) {
+        u8 m = 0;
+        for (usize j = 0; j < 8 && i + j < n; j++)
+            m |= (a[i + j] != b[i + j]) << j;
+        mask[i / 8] = m;
+        any |= m;
+    }
+    return any != 0;
+}
+
+__attribute__((target("sse2")))
+void fill16_sse2(u16 *dst, u16 value, usize n)
+{
+    v8u16 v = {value, value, value, value, value, value, value, value};
+    for (; n >= 8; n -= 8, dst += 8)
+        *(v8u16*) dst = v;
+    fill16_scalar(dst, value, n);
+}
+
+__attribute__((target("sse2")))
+void copy16_sse2(u16 *dst, const u16 *src, usize n)
+{
+    for (; n >= 8; n -= 8, dst += 8, src += 8)
+        *(v8u16*) dst = *(const v8u16*) src;
+    copy16_scalar(dst, src, n);
+}
+
+/* Compare 8 cells at a time and squeeze the 16-bit lane masks down to one bit
+ * per cell with packsswb and pmovmskb. */
+__attribute__((target("sse2")))
+bool diff16_sse2(const u16 *a, const u16 *b, usize n, u8 *mask)
+{
+    u8 any = 0;
+    for (; n >= 8; n -= 8, a += 8, b += 8) {
+        v8s16 ne = (v8s16) (*(const v8u16*) a != *(const v8u16*) b);
+        u8 m = __builtin_ia32_pmovmskb128(__builtin_ia32_packsswb128(ne, ne));
+        *mask++ = m;
+        any |= m;
+    }
+    if (n)
+        any |= diff16_scalar(a, b, n, mask);
+    return any != 0;
+}
+
+void (*fill16)(u16 *dst, u16 value, usize n) = fill16_scalar;
+void (*copy16)(u16 *dst, const u16 *src, usize n) = copy16_scalar;
+bool (*diff16)(const u16 *a, const u16 *b, usize n, u8 *mask) = diff16_scalar;
+
+static inline void cpuid(u32 leaf, u32 *a, u32 *b, u32 *c, u32 *d)
+{
+    asm volatile("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+                         : "a" (leaf), "c" (0));
+}
+
+/* True if the processor has SSE2 and boot.S enabled it (cr4.OSFXSR). */
+bool sse2_usable(void)
+{
+    u32 a, b, c, d;
+    uptr cr4;
+    cpuid(1, &a, &b, &c, &d);
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    return (d & (1 << 26)) && (cr4 & (1 << 9));
+}
+
+/* Select the fastest kernels this processor can run. */
+void vector_init(void)
+{
+    if (sse2_usable()) {
+        fill16 = fill16_sse2;
+        copy16 = copy16_sse2;
+        diff16 = diff16_sse2;
+    }
+}
+
 /* Port I/O */
 
 static inline u8 inb(u16 p)
@@ -41,6 +169,18 @@ static inline void outb(u16 p, u8 d)
     asm("outb %1, %0" : : "dN" (p), "a" (d));
 }
 
+static inline u16 inw(u16 p)
+{
+    u16 r;
+    asm volatile("inw %1, %0" : "=a" (r) : "dN" (p));
+    return r;
+}
+
+static inline void outw(u16 p, u16 d)
+{
+    asm volatile("outw %1, %0" : : "dN" (p), "a" (d));
+}
+
 /* Divide by zero (in a loop to satisfy the noreturn attribute) in order to
  * trigger a division by zero ISR, which is unhandled and causes a hard reset.
  */
@@ -80,6 +220,26 @@ u8 rtcs(void)
 /* The number of CPU ticks per millisecond */
 u64 tpms;
 
+/* Stages of boot timed by boot_trace, from _start (which boot.S stores in
+ * boot_tsc before anything else) to the first frame on screen. Each is
+ * marked by boot_mark the first time the kernel gets there. */
+enum boot_stage {
+    BOOT_MAIN,       /* kernel_main */
+    BOOT_CLEAR,      /* first clear */
+    BOOT_FRAME,      /* first frame presented */
+    BOOT_CALIBRATED, /* tps measured a whole second */
+    BOOT__LENGTH
+};
+
+extern u64 boot_tsc;
+u64 boot_stages[BOOT__LENGTH];
+
+static inline void boot_mark(enum boot_stage stage)
+{
+    if (!boot_stages[stage])
+        boot_stages[stage] = rdtsc();
+}
+
 /* Set tpms to the number of CPU ticks per millisecond based on the number of
  * ticks in the last second, if the RTC second has changed since the last call.
  * This gets called on every iteration of the main loop in order to provide
@@ -87,20 +247,38 @@ u64 tpms;
 void tps(void)
 {
     static u64 ti = 0;
-    static u8 last_sec = 0xFF;
+    static u8 last_sec = 0xFF, changes = 0;
     u8 sec = rtcs();
     if (sec != last_sec) {
         last_sec = sec;
+        /* the first two changes start a second part way through */
+        if (changes < 3 && ++changes == 3)
+            boot_mark(BOOT_CALIBRATED);
         u64 tf = rdtsc();
         tpms = (u32) ((tf - ti) >> 3) / 125; /* Less chance of truncation */
         ti = tf;
     }
 }
 
+/* Microseconds in c CPU ticks, however many. */
+u32 tsc_us(u64 c)
+{
+    return tpms ? (u32) div64(c * 1000, (u32) tpms) : 0;
+}
+
+/* Wait a full second to calibrate timing. */
+void calibrate(void)
+{
+    u64 itpms;
+    tps();
+    itpms = tpms; while (tpms == itpms) tps();
+    itpms = tpms; while (tpms == itpms) tps();
+}
+
 /* IDs used to keep separate timing operations separate */
 enum timer {
-    TIMER_UPDATE,
     TIMER_CLEAR,
+    TIMER_NET,
     TIMER__LENGTH
 };
 
@@ -133,6 +311,117 @@ bool wait(enum timer timer, u32 ms)
     }
 }
 
+/* Interrupts */
+
+/* An IDT gate descriptor, as laid out by the CPU in protected mode, or in
+ * long mode for the x86-64 build. */
+struct idt_entry {
+    u16 offset_lo;
+    u16 selector;
+    u8 zero;
+    u8 type;
+    u16 offset_hi;
+#ifdef __x86_64__
+    u32 offset_top;
+    u32 reserved;
+#endif
+} __attribute__((packed));
+
+/* Vectors 0-31 are CPU exceptions, 32-47 the remapped PIC IRQs. The exception
+ * gates are left not present on purpose: any fault (such as the one raised by
+ * reset()) escalates to a triple fault and resets the machine as before. */
+#define IRQ_BASE (32)
+struct idt_entry idt[IRQ_BASE + 16];
+
+/* Entry points defined in boot.S, indexed by IRQ number. */
+extern void (*const irq_stubs[16])(void);
+
+/* Handlers called from irq_dispatch, indexed by IRQ number. */
+void (*irq_handlers[16])(void);
+
+/* Called from the common IRQ stub in boot.S with interrupts disabled. Run the
+ * handler for irq, if any, and acknowledge the interrupt at the PIC(s). */
+void irq_dispatch(u32 irq)
+{
+    if (irq_handlers[irq])
+        irq_handlers[irq]();
+    if (irq >= 8)
+        outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
+
+/* Remap the PICs to vectors 32-47 with every IRQ masked, and load an IDT with
+ * gates for the IRQ stubs. Interrupts stay disabled until sti. */
+void idt_init(void)
+{
+    u16 cs;
+    asm volatile("mov %%cs, %0" : "=r" (cs));
+    for (u8 i = 0; i < 16; i++) {
+        uptr offset = (uptr) irq_stubs[i];
+        idt[IRQ_BASE + i].offset_lo = offset & 0xFFFF;
+        idt[IRQ_BASE + i].selector = cs;
+        idt[IRQ_BASE + i].zero = 0;
+        idt[IRQ_BASE + i].type = 0x8E; /* present, ring 0, interrupt gate */
+        idt[IRQ_BASE + i].offset_hi = (offset >> 16) & 0xFFFF;
+#ifdef __x86_64__
+        idt[IRQ_BASE + i].offset_top = offset >> 32;
+        idt[IRQ_BASE + i].reserved = 0;
+#endif
+    }
+
+    struct {
+        u16 limit;
+        uptr base;
+    } __attribute__((packed)) idtr = { sizeof(idt) - 1, (uptr) idt };
+    asm volatile("lidt %0" : : "m" (idtr));
+
+    outb(0x20, 0x11); outb(0xA0, 0x11);         /* ICW1: init, expect ICW4 */
+    outb(0x21, IRQ_BASE); outb(0xA1, IRQ_BASE + 8); /* ICW2: vector offsets */
+    outb(0x21, 0x04); outb(0xA1, 0x02);         /* ICW3: slave on IRQ 2 */
+    outb(0x21, 0x01); outb(0xA1, 0x01);         /* ICW4: 8086 mode */
+    outb(0x21, 0xFB); outb(0xA1, 0xFF);         /* mask all but the cascade */
+}
+
+/* Register handler for irq and unmask it at the PIC. */
+void irq_install(u8 irq, void (*handler)(void))
+{
+    irq_handlers[irq] = handler;
+    if (irq >= 8)
+        outb(0xA1, inb(0xA1) & ~(1 << (irq - 8)));
+    else
+        outb(0x21, inb(0x21) & ~(1 << irq));
+}
+
+/* Disable interrupts and return the flags to give irq_restore, for short
+ * sections that must not be interrupted. */
+static inline uptr irq_save(void)
+{
+    uptr flags;
+    asm volatile("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uptr flags)
+{
+    if (flags & (1 << 9)) /* IF */
+        asm volatile("sti" : : : "memory");
+}
+
+/* Number of PIT interrupts since pit_init, at PIT_HZ per second. */
+volatile u32 pit_ticks = 0;
+
+void pit_tick(void);
+
+/* Program PIT channel 0 to interrupt PIT_HZ times per second. */
+void pit_init(void)
+{
+    u16 divisor = 1193182 / PIT_HZ;
+    outb(0x43, 0x36); /* channel 0, lobyte/hibyte, square wave */
+    outb(0x40, divisor & 0xFF);
+    outb(0x40, divisor >> 8);
+    irq_install(0, pit_tick);
+}
+
 /* Video Output */
 
 /* Seven possible display colors. Bright variations can be used by bitwise OR
@@ -149,16 +438,40 @@ enum color {
     BRIGHT
 };
 
-#define COLS (80)
-#define ROWS (25)
-u16 *const video = (u16*) 0xB8000;
+/* Size of the text mode in use, see text_mode. */
+u8 cols = 80, rows = 25;
+#define MAX_COLS (90)
+#define MAX_ROWS (60)
+u16 *const vga = (u16*) 0xB8000;
+
+/* Everything is drawn into video, and present copies the cells that changed
+ * since the last present (according to shown) to VGA memory. Writes to VGA
+ * memory are far slower than to RAM, and most of a frame is the same as the
+ * last one. */
+u16 video[MAX_ROWS * MAX_COLS];
+u16 shown[MAX_ROWS * MAX_COLS];
+u8 changed[(MAX_ROWS * MAX_COLS + 7) / 8];
+
+/* Number of calls to clear, so code that draws incrementally can tell when
+ * what it drew before is gone. */
+u32 clears = 0;
+
+static inline u16 cell(enum color fg, enum color bg, char c)
+{
+    return (bg << 12) | (fg << 8) | (u8) c;
+}
 
 /* Display a character at x, y in fg foreground color and bg background color.
  */
 void putc(u8 x, u8 y, enum color fg, enum color bg, char c)
 {
-    u16 z = (bg << 12) | (fg << 8) | c;
-    video[y * COLS + x] = z;
+    video[y * cols + x] = cell(fg, bg, c);
+}
+
+/* Display n copies of a character starting at x, y. */
+void fill(u8 x, u8 y, u16 n, enum color fg, enum color bg, char c)
+{
+    fill16(&video[y * cols + x], cell(fg, bg, c), n);
 }
 
 /* Display a string starting at x, y in fg foreground color and bg background
@@ -173,10 +486,150 @@ void puts(u8 x, u8 y, enum color fg, enum color bg, const char *s)
 /* Clear the screen to bg backround color. */
 void clear(enum color bg)
 {
-    u8 x, y;
-    for (y = 0; y < ROWS; y++)
-        for (x = 0; x < COLS; x++)
-            putc(x, y, bg, bg, ' ');
+    fill16(video, cell(bg, bg, ' '), rows * cols);
+    clears++;
+    boot_mark(BOOT_CLEAR);
+}
+
+/* Show what has been drawn so far. Runs of changed cells are found 8 at a
+ * time in the change mask and copied in one go. */
+void present(void)
+{
+    u16 n_cells = rows * cols, n_mask = (n_cells + 7) / 8;
+    if (!diff16(video, shown, n_cells, changed))
+        return;
+    for (u16 i = 0; i < n_mask; i++) {
+        if (!changed[i])
+            continue;
+        u16 start = i;
+        while (i < n_mask && changed[i])
+            i++;
+        u16 first = start * 8, n = (i - start) * 8;
+        if (first + n > n_cells)
+            n = n_cells - first;
+        copy16(&vga[first], &video[first], n);
+        copy16(&shown[first], &video[first], n);
+    }
+}
+
+/* Text Modes */
+
+/* Register values of the VGA text modes besides the 80x25 one the bootloader
+ * leaves us in: miscellaneous output, 5 sequencer, 25 CRT controller, 9
+ * graphics controller and 21 attribute controller registers. Both use 8 line
+ * characters: 80x50 is the 80x25 timing with half as tall a font, 90x60 uses
+ * 8 pixel wide characters on 480 lines. The cursor is disabled. */
+const u8 MODE_80X50[61] = {
+    0x67,
+    0x03, 0x00, 0x03, 0x00, 0x02,
+    0x5F, 0x4F, 0x50, 0x82, 0x55, 0x81, 0xBF, 0x1F,
+    0x00, 0x47, 0x20, 0x07, 0x00, 0x00, 0x00, 0x00,
+    0x9C, 0x8E, 0x8F, 0x28, 0x1F, 0x96, 0xB9, 0xA3, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x0E, 0x00, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07,
+    0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x0C, 0x00, 0x0F, 0x08, 0x00
+};
+
+const u8 MODE_90X60[61] = {
+    0xE7,
+    0x03, 0x01, 0x03, 0x00, 0x02,
+    0x6B, 0x59, 0x5A, 0x82, 0x60, 0x8D, 0x0B, 0x3E,
+    0x00, 0x47, 0x20, 0x07, 0x00, 0x00, 0x00, 0x00,
+    0xEA, 0x0C, 0xDF, 0x2D, 0x08, 0xE8, 0x05, 0xA3, 0xFF,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x0E, 0x00, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x14, 0x07,
+    0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x0C, 0x00, 0x0F, 0x08, 0x00
+};
+
+void vga_write_regs(const u8 *r)
+{
+    u8 i;
+
+    outb(0x3C2, *r++);
+    for (i = 0; i < 5; i++) {
+        outb(0x3C4, i);
+        outb(0x3C5, *r++);
+    }
+
+    /* unlock CRTC registers 0-7, and keep them unlocked below */
+    outb(0x3D4, 0x03); outb(0x3D5, inb(0x3D5) | 0x80);
+    outb(0x3D4, 0x11); outb(0x3D5, inb(0x3D5) & ~0x80);
+    for (i = 0; i < 25; i++) {
+        u8 v = *r++;
+        if (i == 0x03)
+            v |= 0x80;
+        if (i == 0x11)
+            v &= ~0x80;
+        outb(0x3D4, i);
+        outb(0x3D5, v);
+    }
+
+    for (i = 0; i < 9; i++) {
+        outb(0x3CE, i);
+        outb(0x3CF, *r++);
+    }
+
+    /* reading input status 1 resets the attribute controller's flip-flop to
+     * expect an index */
+    for (i = 0; i < 21; i++) {
+        inb(0x3DA);
+        outb(0x3C0, i);
+        outb(0x3C0, *r++);
+    }
+    inb(0x3DA);
+    outb(0x3C0, 0x20); /* enable the display again */
+}
+
+/* Replace the 16 line font in plane 2 with an 8 line one, by merging each
+ * pair of lines of every glyph. */
+void vga_font_8(void)
+{
+    volatile u8 *plane2 = (volatile u8*) 0xA0000;
+
+    /* plane 2 alone at 0xA0000, no odd/even addressing */
+    outb(0x3C4, 0x02); outb(0x3C5, 0x04);
+    outb(0x3C4, 0x04); outb(0x3C5, 0x07);
+    outb(0x3CE, 0x04); outb(0x3CF, 0x02);
+    outb(0x3CE, 0x05); outb(0x3CF, 0x00);
+    outb(0x3CE, 0x06); outb(0x3CF, 0x04);
+
+    for (u16 c = 0; c < 256; c++) {
+        volatile u8 *glyph = plane2 + c * 32;
+        for (u8 y = 0; y < 8; y++)
+            glyph[y] = glyph[2 * y] | glyph[2 * y + 1];
+    }
+
+    /* back to text mode access to planes 0 and 1 at 0xB8000 */
+    outb(0x3C4, 0x02); outb(0x3C5, 0x03);
+    outb(0x3C4, 0x04); outb(0x3C5, 0x02);
+    outb(0x3CE, 0x04); outb(0x3CF, 0x00);
+    outb(0x3CE, 0x05); outb(0x3CF, 0x10);
+    outb(0x3CE, 0x06); outb(0x3CF, 0x0E);
+}
+
+/* Switch to the c x r text mode, 80x50 or 90x60. Return false and stay in
+ * 80x25 for any other size. */
+bool text_mode(u32 c, u32 r)
+{
+    const u8 *regs;
+    if (c == 80 && r == 50)
+        regs = MODE_80X50;
+    else if (c == 90 && r == 60)
+        regs = MODE_90X60;
+    else
+        return false;
+    cols = c, rows = r;
+
+    vga_write_regs(regs);
+    vga_font_8();
+
+    /* the old contents no longer line up with the new rows */
+    fill16(shown, 0, MAX_ROWS * MAX_COLS);
+    clear(BLACK);
+    present();
+    return true;
 }
 
 /* Keyboard Input */
@@ -197,6 +650,154 @@ u8 scan(void)
     else return 0;
 }
 
+/* Serial Port */
+
+#define COM1 (0x3F8)
+#define COM2 (0x2F8)
+
+/* Set up port for 115200 baud, 8N1, with FIFOs enabled and interrupts off. */
+void serial_init(u16 port)
+{
+    outb(port + 1, 0x00); /* no interrupts */
+    outb(port + 3, 0x80); /* DLAB on to set the divisor */
+    outb(port + 0, 0x01); /* 115200 / 1 */
+    outb(port + 1, 0x00);
+    outb(port + 3, 0x03); /* DLAB off, 8 bits, no parity, one stop bit */
+    outb(port + 2, 0xC7); /* enable and clear FIFOs, 14 byte threshold */
+    outb(port + 4, 0x03); /* DTR, RTS */
+}
+
+/* Return true if a received byte is waiting in the FIFO. */
+static inline bool serial_received(u16 port)
+{
+    return inb(port + 5) & 0x01;
+}
+
+/* Return true if the transmit FIFO is empty, so up to 16 bytes can be written
+ * without waiting. */
+static inline bool serial_empty(u16 port)
+{
+    return inb(port + 5) & 0x20;
+}
+
+/* Transmit ring for COM1. Writers copy bytes into the ring and the THRE
+ * interrupt (IRQ 4, the transmit holding register is empty) moves them to the
+ * UART 16 at a time, so nobody waits the 87 us a byte takes at 115200 baud.
+ * When the ring is full a write is dropped whole and counted. */
+#define UART_TX_SIZE (4096)
+_Static_assert((UART_TX_SIZE & (UART_TX_SIZE - 1)) == 0,
+               "UART_TX_SIZE must be a power of two");
+
+#define UART_IER_THRE (0x02)
+
+u8 uart_tx[UART_TX_SIZE];
+volatile u32 uart_tx_head = 0, uart_tx_tail = 0; /* free running */
+volatile bool uart_tx_busy = false; /* the THRE interrupt is enabled */
+u32 uart_dropped = 0, uart_dropped_bytes = 0;
+
+/* Queue the n bytes at s, all or none. Safe to call from interrupt handlers.
+ */
+bool uart_write(const char *s, usize n)
+{
+    uptr flags = irq_save();
+    u32 head = uart_tx_head;
+    bool fits = UART_TX_SIZE - (head - uart_tx_tail) >= n;
+    if (fits) {
+        for (usize i = 0; i < n; i++)
+            uart_tx[(head + i) & (UART_TX_SIZE - 1)] = s[i];
+        uart_tx_head = head + n;
+        if (!uart_tx_busy) {
+            /* interrupts right away if the holding register is empty */
+            uart_tx_busy = true;
+            outb(COM1 + 1, UART_IER_THRE);
+        }
+    } else {
+        uart_dropped++;
+        uart_dropped_bytes += n;
+    }
+    irq_restore(flags);
+    return fits;
+}
+
+/* IRQ 4: refill the transmit FIFO from the ring, or turn the interrupt off
+ * once the ring is empty. */
+void uart_irq(void)
+{
+    inb(COM1 + 2); /* reading the interrupt identification acknowledges it */
+    u32 tail = uart_tx_tail;
+    for (u8 i = 0; i < 16 && tail != uart_tx_head; i++)
+        outb(COM1, uart_tx[tail++ & (UART_TX_SIZE - 1)]);
+    uart_tx_tail = tail;
+    if (tail == uart_tx_head) {
+        uart_tx_busy = false;
+        outb(COM1 + 1, 0x00);
+    }
+}
+
+void uart_init(void)
+{
+    serial_init(COM1);
+    outb(COM1 + 4, 0x0B); /* DTR, RTS, OUT2 (connects the IRQ line) */
+    irq_install(4, uart_irq);
+}
+
+/* Debug Console */
+
+/* QEMU's debugcon device (-debugcon stdio) prints whatever is written to port
+ * 0xE9 on the host, without any setup or waiting. */
+#define DEBUGCON (0xE9)
+
+void debugcon_puts(const char *s)
+{
+    for (; *s; s++)
+        outb(DEBUGCON, *s);
+}
+
+/* Leave QEMU with status (code << 1) | 1 through its isa-debug-exit device
+ * (-device isa-debug-exit,iobase=0xf4,iosize=0x04). Without the device,
+ * nothing happens and the caller carries on. */
+#define QEMU_EXIT (0xF4)
+
+void qemu_exit(u8 code)
+{
+    outb(QEMU_EXIT, code);
+}
+
+/* Kernel Command Line */
+
+/* The start of the multiboot information structure passed by the bootloader,
+ * up to the fields used here. */
+struct multiboot_info {
+    u32 flags;
+    u32 mem_lower, mem_upper;
+    u32 boot_device;
+    u32 cmdline;
+};
+
+#define MULTIBOOT_MAGIC   (0x2BADB002)
+#define MULTIBOOT_CMDLINE (1 << 2)
+
+const char *cmdline = "";
+
+/* Return the value of option name on the kernel command line: the text after
+ * "name=" up to the next space, or "" for a bare "name". Return 0 if the
+ * option is not present. */
+const char *cmdline_opt(const char *name)
+{
+    const char *c = cmdline;
+    while (*c) {
+        while (*c == ' ')
+            c++;
+        const char *n = name;
+        while (*n && *c == *n)
+            c++, n++;
+        if (!*n && (*c == '=' || *c == ' ' || !*c))
+            return *c == '=' ? c + 1 : c;
+        while (*c && *c != ' ')
+            c++;
+    }
+    return 0;
+}
 
 /* Formatting */
 
@@ -215,6 +816,137 @@ char *itoa(u32 n, u8 r, u8 w)
     return (char *) (s + i);
 }
 
+/* Return true if strings a and b are equal. */
+bool streq(const char *a, const char *b)
+{
+    while (*a && *a == *b)
+        a++, b++;
+    return *a == *b;
+}
+
+/* Parse the decimal number at the start of s, stopping at the first character
+ * that is not a digit. */
+u32 atou(const char *s)
+{
+    u32 n = 0;
+    for (; *s >= '0' && *s <= '9'; s++)
+        n = n * 10 + (*s - '0');
+    return n;
+}
+
+/* Format fmt with the arguments in ap into buf, which has room for size
+ * bytes including the terminating zero, and return the length of the result,
+ * truncated to fit. Understands %d, %u, %x, %s, %c and %%, with an optional
+ * width, padded with zeros if it starts with 0. Unlike itoa it keeps nothing
+ * in static storage, so it can be used from interrupt handlers. */
+usize vformat(char *buf, usize size, const char *fmt, va_list ap)
+{
+    static const char d[16] = "0123456789ABCDEF";
+    usize n = 0;
+
+#define EMIT(c) do { if (n + 1 < size) buf[n] = (c); n++; } while (0)
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            EMIT(*fmt);
+            continue;
+        }
+        fmt++;
+        char pad = ' ';
+        u8 width = 0;
+        if (*fmt == '0')
+            pad = '0', fmt++;
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+            width = width * 10 + (*fmt - '0');
+
+        char digits[12];
+        u8 len = 0;
+        const char *str = 0;
+        bool negative = false;
+        u32 u;
+        switch (*fmt) {
+        case 'd': {
+            s32 v = va_arg(ap, s32);
+            negative = v < 0;
+            u = negative ? -(u32) v : (u32) v;
+            do digits[len++] = d[u % 10]; while (u /= 10);
+            break;
+        }
+        case 'u':
+            u = va_arg(ap, u32);
+            do digits[len++] = d[u % 10]; while (u /= 10);
+            break;
+        case 'x':
+            u = va_arg(ap, u32);
+            do digits[len++] = d[u & 0xF]; while (u >>= 4);
+            break;
+        case 's':
+            str = va_arg(ap, const char *);
+            while (str[len])
+                len++;
+            break;
+        case 'c':
+            digits[len++] = (char) va_arg(ap, int);
+            break;
+        case '%':
+            digits[len++] = '%';
+            break;
+        default: /* unknown, or the string ended */
+            fmt--;
+            continue;
+        }
+
+        if (negative && pad == '0')
+            EMIT('-');
+        for (u8 w = len + negative; w < width; w++)
+            EMIT(pad);
+        if (negative && pad != '0')
+            EMIT('-');
+        if (str)
+            for (u8 i = 0; i < len; i++)
+                EMIT(str[i]);
+        else
+            while (len)
+                EMIT(digits[--len]);
+    }
+#undef EMIT
+
+    if (size)
+        buf[n < size ? n : size - 1] = 0;
+    return n < size ? n : size ? size - 1 : 0;
+}
+
+usize format(char *buf, usize size, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    usize n = vformat(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+/* Logging */
+
+/* Log lines go to COM1 through the transmit ring (qemu -serial stdio shows
+ * them), each prefixed with the PIT tick. Off unless "log" is on the kernel
+ * command line. */
+#define LOG_LINE (128)
+
+bool logging = false;
+
+void klog(const char *fmt, ...)
+{
+    if (!logging)
+        return;
+    char line[LOG_LINE];
+    usize n = format(line, LOG_LINE, "%u ", pit_ticks);
+    va_list ap;
+    va_start(ap, fmt);
+    n += vformat(line + n, LOG_LINE - n - 1, fmt, ap);
+    va_end(ap);
+    line[n++] = '\n';
+    uart_write(line, n);
+}
+
 /* Random */
 
 /* Generate a random number from 0 inclusive to range exclusive from the number
@@ -237,339 +969,434 @@ void shuffle(u8 arr[], u32 len)
     }
 }
 
-u8 TETRIS[5][2][3] = { // 4 enemies of different colors
-    { /* I */ //enemies 1, 2, 3 y 4
-        {6,6,6},
-        {0,6,0}
-    },
-    { /* J */
-        {7,7,7},
-        {0,7,0}
-    },
-    { /* L */
-        {5,5,5},
-        {0,5,0}
-    },
-    { /* O */
-        {1,1,1},
-        {0,1,0}
-    },
-    { /* O */ // for the player
-        {0,3,0},
-        {3,3,3}
-    }
-};
-
+/* Sound */
 
-struct Nave{
-    u8 i; // Index for este color
-    s8 x, y; // position
-    bool existe;    // to know if exists or not
+/* A note of a sound effect: a square wave of freq Hz (0 for silence) held for
+ * ms milliseconds. A note with ms == 0 ends the sequence. */
+struct nota {
+    u16 freq;
+    u16 ms;
 };
 
-struct Bala{
-	s8 x,y; // position
-	bool existe; // to know if exists, 0 -> does not exists
+const struct nota SOUND_NOTES_SHOT[]  = {{1400, 12}, {1000, 12}, {0, 0}};
+const struct nota SOUND_NOTES_HIT[]   = {{300, 20}, {200, 30}, {0, 0}};
+const struct nota SOUND_NOTES_LIFE[]  = {{660, 80}, {0, 20}, {440, 80}, {0, 20},
+                                         {220, 200}, {0, 0}};
+const struct nota SOUND_NOTES_LEVEL[] = {{523, 70}, {659, 70}, {784, 70},
+                                         {1047, 160}, {0, 0}};
+
+const struct nota *const sounds[SOUND__LENGTH] = {
+    SOUND_NOTES_SHOT,
+    SOUND_NOTES_HIT,
+    SOUND_NOTES_LIFE,
+    SOUND_NOTES_LEVEL
 };
 
-struct Nave aliado; // variable for player
-struct Nave enemigo[4]; // array for enemies
-struct Bala bala[4]; // array for bullets
-struct Bala rocas[3]; // Array of rocks, for level 2
-
-/* Shuffled bag of next tetrimino indices */
-#define BAG_SIZE (4)
-u8 bag[BAG_SIZE] = {0, 1, 2, 3};
-
-u32 position[20];
-
-u32 score = 0, level = 1, vidas = 3, speed = INITIAL_SPEED;
-
-bool paused = false, game_over = false;
-
-/* Return true if the tetrimino i in rotation r will collide when placed at x,
- * y. */
-bool collide(s8 x, s8 y) // collision with the borders of the screen
-{
-    u8 xx, yy;
-    if (x < 1 || x > (WELL_WIDTH -3) ||  y <= 0 || y >= WELL_HEIGHT) return true;
-    else return false;
-}
-
-bool collide2(s8 x, s8 y) // collisions with the borders of the screen
-{
-    u8 xx, yy;
-    if (x < position[1] + 1 || x + 1 > (position[1] + 9) ||  y <= 0 || y >= WELL_HEIGHT){
-    	aliado.existe = false;
-    	vidas -= 1;
-    	return true;
-	}
-    else return false;
-}
-
-void check_collisions(void){
-	// for bullets againts enemies
-	for (int lyd = 0; lyd < 4; lyd++){//for of bullets
-		if (bala[lyd].existe){
-			for (int xd = 0; xd < 4; xd++){//for of the enemies
-				if ((bala[lyd].y == enemigo[xd].y) || bala[lyd].y == enemigo[xd].y + 1){
-					if ((bala[lyd].x == enemigo[xd].x) || (bala[lyd].x == enemigo[xd].x + 1) || (bala[lyd].x == enemigo[xd].x + 2)){
-						bala[lyd].existe = false;
-						enemigo[xd].existe = false;
-						score += 1;
-						return;
-					}
-				}
-			}
-		}
-	}
-
-
-	// player against enemies
-	for (int xd = 0; xd < 4; xd++){//for de los enemigos
-		for (int w = 0; w < 2; w++){
-			if ((aliado.y + w == enemigo[xd].y) || aliado.y + w == enemigo[xd].y + 1){
-				for (int z = 0; z < 3; z++){
-					if ((aliado.x + z == enemigo[xd].x) || (aliado.x + z == enemigo[xd].x + 1) ||(aliado.x + z == enemigo[xd].x +2)){
-						aliado.existe = false;
-						enemigo[xd].existe = false;
-						vidas -= 1;
-						return;
-					}
-				}
-			}
-		}
-	}
-}
-
-void check_collisions_rocas(void){ // check collision rocks
-	for (int xd = 0; xd < 3; xd++){
-		if ((aliado.y == rocas[xd].y)){
-			if (aliado.x == rocas[xd].x || aliado.x + 1 == rocas[xd].x || aliado.x + 2 == rocas[xd].x){
-				aliado.existe = false;
-				vidas -= 1;
-				break;
-			}
-		}
-		if (aliado.y - 1 == rocas[xd].y){
-			if (aliado.x + 1 == rocas[xd].x){
-				aliado.existe = false;
-				vidas -= 1;
-				break;
-			}
-		}
-	}
-}
-
-void check_game_over(){
-	if (vidas == 0){
-		game_over = true;
-	}
-}
-
-bool level2 = false;
-
-void check_level_change(){
-	if (score >= 20){
-		level2 = true;
-		level = 2;
-	}
-}
-
-void inicializar(void) // to create player, enemies and bullets for level 1
-{
-
-	aliado.i = 4;
-	aliado.y = WELL_HEIGHT - 2;
-	aliado.x = (WELL_WIDTH/2); //WELL_WIDTH/2) - 8
-	aliado.existe = false;
-
-	for (int lyd = 0; lyd < 4; lyd++){
-	    enemigo[lyd].i = lyd;
-	    enemigo[lyd].x = (lyd*5) + 1; // define a random position
-	    enemigo[lyd].y = 4; // initial position in y
-	    enemigo[lyd].existe = false;
-		
-	}
-
-	for (int lyd = 0; lyd < 4; lyd++){ // to create the bullets
-	    bala[lyd].x = 10; // just to give a number, it will be defined as the players position
-	    bala[lyd].y = WELL_HEIGHT - 3; // initial position in y
-	    bala[lyd].existe = false;  
-	}
-}
-
-void inicializar2(void) // this is to create player and rocks, for level 2
-{
-
-	aliado.i = 4;
-	aliado.y = WELL_HEIGHT - 2;
-	aliado.x = (position[1]) + 4; //WELL_WIDTH/2) - 8
-	aliado.existe = false;
-
-	u32 hola;
-
-	for (hola = 0; hola < 11; hola++){
-		position[hola] = hola;
-	}
-
-	u32 temp = 9;
-
-	for (hola = 11; hola < 20; hola++){
-		position[hola] = temp;
-		temp -= 1;
-	}
+/* Queue of sounds to play, written only by sound_play in the main loop and
+ * read only by the sequencer in the PIT interrupt. Each side owns one index,
+ * so no locking is needed. One slot is kept free to tell full from empty. */
+#define SOUND_QUEUE_SIZE (8)
+volatile u8 sound_queue[SOUND_QUEUE_SIZE];
+volatile u8 sound_head = 0, sound_tail = 0;
 
-	rocas[0].x = position[17] + 2; 
-	rocas[0].y = 2; 
-	rocas[0].existe = true; 
+/* State of the sequencer, only touched from the PIT interrupt. */
+const struct nota *sound_note = 0;
+u32 sound_left = 0;
 
-	rocas[1].x = position[14] + 7; 
-	rocas[1].y = 5; 
-	rocas[1].existe = true; 
+/* Play freq Hz on the PC speaker through PIT channel 2, or silence it if freq
+ * is 0. */
+void speaker(u16 freq)
+{
+    if (!freq) {
+        outb(0x61, inb(0x61) & ~0x03);
+        return;
+    }
+    u16 divisor = 1193182 / freq;
+    outb(0x43, 0xB6); /* channel 2, lobyte/hibyte, square wave */
+    outb(0x42, divisor & 0xFF);
+    outb(0x42, divisor >> 8);
+    outb(0x61, inb(0x61) | 0x03); /* gate channel 2 and enable the speaker */
+}
 
-	rocas[2].x = position[4] + 9; 
-	rocas[2].y = 15; 
-	rocas[2].existe = true; 
+/* Queue sound to be played after any already queued. Never blocks: if the
+ * queue is full the sound is dropped. */
+void sound_play(enum sound sound)
+{
+    u8 next = (sound_head + 1) % SOUND_QUEUE_SIZE;
+    if (next == sound_tail)
+        return;
+    sound_queue[sound_head] = sound;
+    asm volatile("" : : : "memory"); /* publish the entry before the index */
+    sound_head = next;
 }
 
-void spawn(void) // If does not exist, create it
+/* Queue the sounds the game asked for since the last call. */
+void sound_flush(struct juego *j)
 {
-	if (aliado.existe == false){
-		aliado.y = WELL_HEIGHT - 2;
-		aliado.x = (WELL_WIDTH/2) - 1; //WELL_WIDTH/2) - 8
-		aliado.existe = true;
-	}
+    for (u8 i = 0; i < SOUND__LENGTH; i++)
+        if (j->sonidos & (1 << i))
+            sound_play(i);
+    j->sonidos = 0;
+}
 
-	for (int lyd = 0; lyd < 4; lyd++){
-	    if (enemigo[lyd].existe == false){
-	    	enemigo[lyd].x = (lyd*5) + 1; // define la posicion con un random
-	    	enemigo[lyd].y = 4; // posicion inicial en y
-		    enemigo[lyd].existe = true;
-		    return;
-		}
-	}
+/* Start note, or the next queued sound if note ends its sequence. */
+void sound_start(const struct nota *note)
+{
+    if (!note || !note->ms) {
+        note = 0;
+        if (sound_tail != sound_head) {
+            note = sounds[sound_queue[sound_tail]];
+            sound_tail = (sound_tail + 1) % SOUND_QUEUE_SIZE;
+        }
+    }
+    sound_note = note;
+    if (note) {
+        sound_left = (u32) note->ms * PIT_HZ / 1000;
+        speaker(note->freq);
+    } else speaker(0);
 }
 
-void spawn2(void) // If does not exist, create it
+/* Advance the sequencer by one PIT tick. */
+void sound_step(void)
 {
-	if (aliado.existe == false){
-		aliado.y = WELL_HEIGHT - 2;
-		aliado.x = (position[1]) + 4; //WELL_WIDTH/2) - 8
-		aliado.existe = true;
-	}
+    if (sound_note) {
+        if (sound_left && --sound_left)
+            return;
+        sound_start(sound_note + 1);
+    } else if (sound_tail != sound_head)
+        sound_start(0);
+}
 
-	for (int lyd = 0; lyd < 3; lyd++){
-		if (rocas[lyd].existe == false){
-	    	rocas[lyd].y = 0; // posicion inicial en y
-	    	rocas[lyd].existe = true; // estaba en false
-		}
-	}
+void pit_tick(void)
+{
+    pit_ticks++;
+    sound_step();
 }
 
+/* Disk */
 
-/* Try to move the enemigo[lyd] tetrimino by dx, dy and return true if successful.
- */
-bool move_bichito(s8 dx, s8 dy) // to move player
+/* ATA PIO on the master drive of the primary channel (qemu -hda). Reads only
+ * happen at boot, where waiting is fine. Writes are queued and disk_step,
+ * called on every iteration of the main loop, moves the one at the head along
+ * without ever waiting: it issues the command, sends the sector a few words
+ * at a time, then flushes the drive's cache. The drive's interrupt is left
+ * disabled (nIEN) since the main loop polls anyway, and on static scenes the
+ * PIT wakes it from hlt every millisecond. */
+
+#define ATA_DATA    (0x1F0)
+#define ATA_COUNT   (0x1F2)
+#define ATA_LBA0    (0x1F3)
+#define ATA_LBA1    (0x1F4)
+#define ATA_LBA2    (0x1F5)
+#define ATA_DRIVE   (0x1F6)
+#define ATA_STATUS  (0x1F7) /* when read */
+#define ATA_COMMAND (0x1F7) /* when written */
+#define ATA_CONTROL (0x3F6) /* alternate status when read */
+
+#define ATA_ERR (1 << 0)
+#define ATA_DRQ (1 << 3)
+#define ATA_DF  (1 << 5)
+#define ATA_BSY (1 << 7)
+
+#define ATA_READ     (0x20)
+#define ATA_WRITE    (0x30)
+#define ATA_FLUSH    (0xE7)
+#define ATA_IDENTIFY (0xEC)
+
+#define SECTOR_SIZE (512)
+
+/* Status polls before a wait at boot gives up on the drive */
+#define ATA_TIMEOUT (1000000)
+
+/* Words of a sector sent per disk_step */
+#define DISK_STEP_WORDS (32)
+
+bool disk_present = false;
+
+/* Give the drive the 400 ns it needs to update its status after a command. */
+void ata_delay(void)
 {
-	if(!(aliado.existe)) return false; // if does not exist, no need to do anything
-    if (collide(aliado.x + dx, aliado.y + dy))
-        return false;
-    aliado.x += dx;
-    aliado.y += dy;
-    return true;
+    for (u8 i = 0; i < 4; i++)
+        inb(ATA_CONTROL);
 }
 
-bool move_bichito2(s8 dx, s8 dy) // to move player level 2
+/* Wait until the drive is not busy and return its status, or ATA_ERR if it
+ * takes too long. */
+u8 ata_wait(void)
 {
-	if(!(aliado.existe)) return false; // if does not exist, no need to do anything
-    if (collide2(aliado.x + dx, aliado.y + dy)){
-        return false;
+    ata_delay();
+    for (u32 i = 0; i < ATA_TIMEOUT; i++) {
+        u8 status = inb(ATA_STATUS);
+        if (!(status & ATA_BSY))
+            return status;
     }
-    aliado.x += dx;
-    aliado.y += dy;
-    return true;
+    return ATA_ERR;
+}
+
+/* Set up a one sector command on sector lba of the master drive. */
+void ata_select(u32 lba)
+{
+    outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F)); /* master, LBA */
+    outb(ATA_COUNT, 1);
+    outb(ATA_LBA0, lba);
+    outb(ATA_LBA1, lba >> 8);
+    outb(ATA_LBA2, lba >> 16);
 }
 
-bool move_enemigo(s8 dx, s8 dy, s8 lol) // for enemies
+/* Return true if there is an ATA disk (not a CD drive) to use. */
+bool ata_init(void)
 {
-    if(!(enemigo[lol].existe)) return false; // if does not exist, no need to do anything
-    if (collide(enemigo[lol].x + dx, enemigo[lol].y + dy))
+    outb(ATA_CONTROL, 0x02); /* nIEN: no interrupts */
+    if (inb(ATA_STATUS) == 0xFF)
+        return false; /* nothing on the bus */
+
+    outb(ATA_DRIVE, 0xA0);
+    outb(ATA_COUNT, 0);
+    outb(ATA_LBA0, 0);
+    outb(ATA_LBA1, 0);
+    outb(ATA_LBA2, 0);
+    outb(ATA_COMMAND, ATA_IDENTIFY);
+    if (inb(ATA_STATUS) == 0)
+        return false; /* no drive */
+    u8 status = ata_wait();
+    if (inb(ATA_LBA1) || inb(ATA_LBA2))
+        return false; /* ATAPI */
+    if ((status & ATA_ERR) || !(status & ATA_DRQ))
         return false;
-    enemigo[lol].x += dx;
-    enemigo[lol].y += dy;
+    for (u16 i = 0; i < SECTOR_SIZE / 2; i++)
+        inw(ATA_DATA);
     return true;
 }
 
-bool move_bala(s8 dx, s8 dy, s8 lol) // for bullets
+/* Read sector lba into buf, waiting for the drive. */
+bool ata_read(u32 lba, u16 *buf)
 {
-    if((bala[lol].existe)== false) return false; // if does not exist, no need to do anything
-    if (collide(bala[lol].x + dx, bala[lol].y + dy))
+    ata_select(lba);
+    outb(ATA_COMMAND, ATA_READ);
+    u8 status = ata_wait();
+    if ((status & (ATA_ERR | ATA_DF)) || !(status & ATA_DRQ))
         return false;
-    bala[lol].x += dx;
-    bala[lol].y += dy;
+    for (u16 i = 0; i < SECTOR_SIZE / 2; i++)
+        buf[i] = inw(ATA_DATA);
     return true;
 }
 
-bool move_rocas(s8 dx, s8 dy, s8 lol) // for rocks
+/* Write-behind queue */
+
+#define DISK_QUEUE (4)
+
+struct disk_write {
+    u32 lba;
+    u16 data[SECTOR_SIZE / 2];
+};
+
+struct disk_write disk_queue[DISK_QUEUE];
+u8 disk_head = 0, disk_count = 0;
+
+enum disk_state {
+    DISK_IDLE,    /* no write started */
+    DISK_COMMAND, /* write command sent, waiting for the drive to take data */
+    DISK_DATA,    /* sending the sector */
+    DISK_WRITING, /* waiting for the drive to write it */
+    DISK_FLUSH    /* waiting for the drive to flush its cache */
+} disk_state = DISK_IDLE;
+
+u16 disk_words = 0; /* of the sector at the head sent so far */
+u32 disk_writes = 0, disk_errors = 0;
+
+/* Queue sector lba to be written with the SECTOR_SIZE bytes at data. A queued
+ * write of the same sector that has not started yet is replaced instead.
+ * Return false if there is no disk or the queue is full. */
+bool disk_write(u32 lba, const void *data)
 {
-    if((rocas[lol].existe)== false) return false; // if does not exist, no need to do anything
-    if (collide(rocas[lol].x + dx, rocas[lol].y + dy))
+    if (!disk_present)
         return false;
-    rocas[lol].x += dx;
-    rocas[lol].y += dy;
+    for (u8 i = 0; i < disk_count; i++) {
+        struct disk_write *w = &disk_queue[(disk_head + i) % DISK_QUEUE];
+        if (w->lba == lba && (i > 0 || disk_state == DISK_IDLE)) {
+            memcpy(w->data, data, SECTOR_SIZE);
+            return true;
+        }
+    }
+    if (disk_count == DISK_QUEUE)
+        return false;
+    struct disk_write *w = &disk_queue[(disk_head + disk_count++) % DISK_QUEUE];
+    w->lba = lba;
+    memcpy(w->data, data, SECTOR_SIZE);
     return true;
 }
 
-/* Update the game state. Called at an interval relative to the enemigo[lyd] level.
- */
-void update(void)
+/* Finish with the write at the head of the queue. */
+void disk_done(bool ok)
 {
-	for (int lyd = 0; lyd < 4; lyd++){
-	    if (!(move_enemigo(0, 1, lyd))) enemigo[lyd].existe = false;
-	    if (!(move_bala(0, -1, lyd))) bala[lyd].existe = false; 
-	}
-	spawn();
+    if (ok)
+        disk_writes++;
+    else
+        disk_errors++;
+    klog("disk: sector %u %s", disk_queue[disk_head].lba, ok ? "written" : "failed");
+    disk_head = (disk_head + 1) % DISK_QUEUE;
+    disk_count--;
+    disk_state = DISK_IDLE;
 }
 
-void update2(void) // update for level 2
+/* Move the queued writes along as far as possible without waiting. */
+void disk_step(void)
 {
-	for (int lyd = 0; lyd < 4; lyd++){
-	    if (!(move_enemigo(0, 1, lyd))) enemigo[lyd].existe = false; 
-	}
-	for (int lyd = 0; lyd < 3; lyd++){
-		if (!(move_rocas(0, 1, lyd))){
-			score += 1;
-			rocas[lyd].existe = false; 
-		}
-	}
-	u32 temp_position[20];
+    u8 status;
+
+    if (!disk_count)
+        return;
+    switch (disk_state) {
+    case DISK_IDLE:
+        if (inb(ATA_STATUS) & ATA_BSY)
+            return;
+        ata_select(disk_queue[disk_head].lba);
+        outb(ATA_COMMAND, ATA_WRITE);
+        disk_words = 0;
+        disk_state = DISK_COMMAND;
+        return;
+    case DISK_COMMAND:
+        status = inb(ATA_STATUS);
+        if (status & ATA_BSY)
+            return;
+        if (status & (ATA_ERR | ATA_DF)) {
+            disk_done(false);
+            return;
+        }
+        if (!(status & ATA_DRQ))
+            return;
+        disk_state = DISK_DATA;
+        /* fall through */
+    case DISK_DATA:
+        for (u8 i = 0; i < DISK_STEP_WORDS && disk_words < SECTOR_SIZE / 2; i++)
+            outw(ATA_DATA, disk_queue[disk_head].data[disk_words++]);
+        if (disk_words == SECTOR_SIZE / 2)
+            disk_state = DISK_WRITING;
+        return;
+    case DISK_WRITING:
+    case DISK_FLUSH:
+        status = inb(ATA_STATUS);
+        if (status & ATA_BSY)
+            return;
+        if (status & (ATA_ERR | ATA_DF))
+            disk_done(false);
+        else if (disk_state == DISK_WRITING) {
+            outb(ATA_COMMAND, ATA_FLUSH);
+            disk_state = DISK_FLUSH;
+        } else
+            disk_done(true);
+        return;
+    }
+}
 
-	for (int lyd = 0; lyd < 20; lyd++){
-		temp_position[lyd] = position[lyd];
-	}
+/* High Scores */
 
-	for (int lyd = 0; lyd < 19; lyd++){
-		position[lyd] = temp_position[lyd+1];
-	}
-	position[19] = temp_position[0];
+/* The best HISCORES games and the number of games played, in sector
+ * HISCORE_LBA of the disk with a checksum, so a blank or foreign disk is not
+ * mistaken for a table. The sector of a foreign disk holds someone else's
+ * data (on most disks sector 0 is the boot sector), so it is never written. */
+#define HISCORE_MAGIC (0x43534948) /* "HISC" */
 
-	spawn2();
+struct hiscore {
+    u32 score, level;
+};
+
+struct hiscore_table {
+    u32 magic;
+    u32 partidas;
+    struct hiscore tabla[HISCORES];
+    u32 checksum; /* FNV-1a of everything above */
+};
+
+_Static_assert(sizeof(struct hiscore_table) <= SECTOR_SIZE,
+               "the high score table must fit in a sector");
+
+struct hiscore_table hiscores;
+s8 hiscore_place = -1; /* of the last game in the table, -1 if not in it */
+
+u32 hiscore_checksum(const struct hiscore_table *h)
+{
+    const u8 *b = (const u8 *) h;
+    u32 hash = 2166136261u;
+    for (usize i = 0; i < __builtin_offsetof(struct hiscore_table, checksum); i++)
+        hash = (hash ^ b[i]) * 16777619u;
+    return hash;
+}
+
+/* Return true if the sector is all zeros. */
+bool sector_blank(const u16 *sector)
+{
+    for (u16 i = 0; i < SECTOR_SIZE / 2; i++)
+        if (sector[i])
+            return false;
+    return true;
+}
+
+/* Load the table from the disk, or start an empty one. Unless the sector held
+ * a table or was blank, the disk is let go and the table is not saved. */
+void hiscore_load(void)
+{
+    static u16 sector[SECTOR_SIZE / 2];
+    if (disk_present && ata_read(HISCORE_LBA, sector)) {
+        memcpy(&hiscores, sector, sizeof(hiscores));
+        if (hiscores.magic == HISCORE_MAGIC &&
+            hiscores.checksum == hiscore_checksum(&hiscores)) {
+            klog("hiscores: loaded, best %u", hiscores.tabla[0].score);
+            return;
+        }
+        if (!sector_blank(sector)) {
+            klog("hiscores: sector %u is in use, not saving", HISCORE_LBA);
+            disk_present = false;
+        }
+    } else if (disk_present) {
+        klog("hiscores: sector %u unreadable, not saving", HISCORE_LBA);
+        disk_present = false;
+    }
+    klog("hiscores: %s, starting empty", disk_present ? "blank disk" : "no disk");
+    memset(&hiscores, 0, sizeof(hiscores));
+    hiscores.magic = HISCORE_MAGIC;
 }
 
-void disparar(void){ // to shoot the bullets
-	for (int lyd = 0; lyd < 4; lyd++){
-		if (bala[lyd].existe == false){
-			bala[lyd].existe = true;
-			bala[lyd].x = aliado.x + 1; // create it in front of the player position
-			bala[lyd].y = aliado.y - 1;
-			return;
-		}
-	}
+/* Enter a finished game in the table and queue the table to be saved. */
+void hiscore_submit(u32 score, u32 level)
+{
+    static u16 sector[SECTOR_SIZE / 2];
+
+    hiscores.partidas++;
+    hiscore_place = -1;
+    for (s8 i = 0; i < HISCORES; i++)
+        if (score > hiscores.tabla[i].score) {
+            hiscore_place = i;
+            break;
+        }
+    if (hiscore_place >= 0) {
+        for (s8 i = HISCORES - 1; i > hiscore_place; i--)
+            hiscores.tabla[i] = hiscores.tabla[i - 1];
+        hiscores.tabla[hiscore_place] = (struct hiscore) {score, level};
+    }
+    hiscores.checksum = hiscore_checksum(&hiscores);
+
+    memset(sector, 0, SECTOR_SIZE);
+    memcpy(sector, &hiscores, sizeof(hiscores));
+    disk_write(HISCORE_LBA, sector);
+    klog("hiscores: game %u score %u place %d", hiscores.partidas, score, hiscore_place);
 }
 
-#define TITLE_X (COLS / 2 - 9)
-#define TITLE_Y (ROWS / 2 - 10)
+struct campo campo; // flow field of the game being played
+struct juego juego = {.campo = &campo}; // the game being played
+
+/* Shuffled bag of next tetrimino indices */
+#define BAG_SIZE (4)
+u8 bag[BAG_SIZE] = {0, 1, 2, 3};
+
+u32 speed = INITIAL_SPEED;
+
+bool paused = false;
+
+bool netplay = false; // two players over the serial port, see Netplay below
+
+#define TITLE_X (cols / 2 - 9)
+#define TITLE_Y (rows / 2 - 10)
 
 /* Draw about information in the centre. Shown on boot and pause. */
 void draw_about(void) {
@@ -628,6 +1455,16 @@ void draw_game_over(void){
     puts(TITLE_X + 15, TITLE_Y + 2, BLACK,                    YELLOW, "   ");
 
     puts(TITLE_X - 10, TITLE_Y + 10, GRAY, BLACK, "          Press P to continue       ");	
+
+    /* High scores, with this game's place highlighted */
+    puts(TITLE_X + 3, TITLE_Y + 13, GRAY, BLACK, "HIGH SCORES");
+    for (s8 i = 0; i < HISCORES && hiscores.tabla[i].score; i++) {
+        enum color fg = i == hiscore_place ? BRIGHT | YELLOW : GRAY;
+        puts(TITLE_X + 3,  TITLE_Y + 14 + i, fg, BLACK, itoa(i + 1, 10, 1));
+        puts(TITLE_X + 5,  TITLE_Y + 14 + i, fg, BLACK, itoa(hiscores.tabla[i].score, 10, 5));
+        puts(TITLE_X + 11, TITLE_Y + 14 + i, fg, BLACK, "LEVEL");
+        puts(TITLE_X + 17, TITLE_Y + 14 + i, fg, BLACK, itoa(hiscores.tabla[i].level, 10, 1));
+    }
 }
 
 void draw_level_2(void){
@@ -653,16 +1490,17 @@ void draw_level_2(void){
     puts(TITLE_X - 10, TITLE_Y + 10, GRAY, BLACK, "          Press P to continue       ");	
 }
 
-#define WELL_X (COLS / 2 - WELL_WIDTH)
+#define WELL_X (cols / 2 - juego.ancho)
+#define WELL_RIGHT (cols / 2 + juego.ancho)
 
-#define PREVIEW_X (COLS * 3/4 + 1)
+#define PREVIEW_X (cols * 3/4 + 1)
 #define PREVIEW_Y (2)
 
-#define STATUS_X (COLS * 3/4)
-#define STATUS_Y (ROWS / 2 - 4)
+#define STATUS_X (WELL_RIGHT - 2)
+#define STATUS_Y (rows / 2 - 4)
 
 #define SCORE_X STATUS_X
-#define SCORE_Y (ROWS / 2 - 1)
+#define SCORE_Y (rows / 2 - 1)
 
 #define LEVEL_X SCORE_X
 #define LEVEL_Y (SCORE_Y + 4)
@@ -670,347 +1508,1698 @@ void draw_level_2(void){
 #define VIDAS_X SCORE_X
 #define VIDAS_Y (SCORE_Y + 8)
 
-void draw(int posicion) // position goes for 0 to 3, 
-{
-    u8 x, y;
+/* Well */
 
-    if (paused) {
-        draw_about();
-        goto status;
-    }
+/* The background of the well is only drawn in full after the screen was
+ * cleared. After that each frame paints the background back over what the
+ * last frame drew on it (ships, bullets, rocks, the corridor) and draws those
+ * again, so the cost of a frame depends on the number of things in the well
+ * and not on its size. */
 
-    /* Border */ // para borrar las paredes que se mueven
-    for (y = 2; y <= WELL_HEIGHT; y++) {
-        putc(WELL_X - 1,            y, GRAY, BLACK, ' ');
-        putc(COLS / 2 + WELL_WIDTH, y, GRAY, BLACK, ' ');
-    }
+#define SPRITES_MAX (192)
+struct sprite {
+    u8 x, y, n;
+} sprites[SPRITES_MAX];
+u16 n_sprites = 0;
+u32 well_clears = -1; /* clears when the background was last drawn in full */
 
-    /* Border */ // para pintar las paredes
-    for (y = 2 + posicion; y <= WELL_HEIGHT; y+=4) {
-        putc(WELL_X - 1,            y, BLACK, GRAY, ' ');
-        putc(COLS / 2 + WELL_WIDTH, y, BLACK, GRAY, ' ');
+/* Paint the background of the well over n cells of row y from x. */
+void well_background(u8 x, u8 y, u8 n)
+{
+    if (y < 2)
+        fill(x, y, n, BLACK, BLACK, ' ');
+    else
+        fill(x, y, n, BRIGHT, BLACK, ':');
+}
+
+/* Get the well ready for the entities of a new frame. */
+void well_begin(void)
+{
+    if (well_clears != clears) {
+        for (u8 y = 0; y <= juego.alto; y++)
+            well_background(WELL_X, y, juego.ancho * 2);
+        n_sprites = 0;
+        well_clears = clears;
+        return;
     }
-    for (x = 1; x < WELL_WIDTH * 2 + 1; x++)
-        putc(WELL_X + x - 1, WELL_HEIGHT, BRIGHT, BLACK, ':');
+    for (u16 i = 0; i < n_sprites; i++)
+        well_background(sprites[i].x, sprites[i].y, sprites[i].n);
+    n_sprites = 0;
+}
 
-    /* Well */
-    for (y = 0; y < 2; y++)
-        for (x = 0; x < WELL_WIDTH; x++)
-            puts(WELL_X + x * 2, y, BLACK, BLACK, "  ");
-    for (y = 2; y < WELL_HEIGHT; y++)
-        for (x = 0; x < WELL_WIDTH; x++)
-            puts(WELL_X + x * 2, y, BRIGHT, BLACK, "::");
+/* puts for things in the well, remembered so well_begin can erase them. */
+void sprite(u8 x, u8 y, enum color fg, enum color bg, const char *s)
+{
+    u8 n = 0;
+    while (s[n])
+        n++;
+    puts(x, y, fg, bg, s);
+    if (n_sprites < SPRITES_MAX)
+        sprites[n_sprites++] = (struct sprite) {x, y, n};
+}
 
-    /* enemigo[lyd] */
-    for (int lyd = 0; lyd < 4; lyd++){
-    	if (enemigo[lyd].existe == true)
-		    for (y = 0; y < 2; y++)
-		        for (x = 0; x < 3; x++)
-		            if (TETRIS[enemigo[lyd].i][y][x])
-		                puts(WELL_X + enemigo[lyd].x * 2 + x * 2, enemigo[lyd].y + y, BLACK,
-		                     TETRIS[enemigo[lyd].i][y][x], "  ");
-    }
+/* The side walls, with a gap every 4 rows that moves with posicion. */
+void draw_walls(int posicion)
+{
+    u8 y;
 
-    /* bala[lyd] */
-    for (int lyd = 0; lyd < 4; lyd++){
-    	if (bala[lyd].existe == true)
-            puts(WELL_X + bala[lyd].x * 2, bala[lyd].y, 4, BLACK, "ll");
+    /* Border */ // para borrar las paredes que se mueven
+    for (y = 2; y <= juego.alto; y++) {
+        putc(WELL_X - 1, y, GRAY, BLACK, ' ');
+        putc(WELL_RIGHT, y, GRAY, BLACK, ' ');
     }
 
-    // aliado
-    if (aliado.existe == true)
-	    for (y = 0; y < 2; y++)
-		        for (x = 0; x < 3; x++)
-		            if (TETRIS[aliado.i][y][x])
-		                puts(WELL_X + aliado.x * 2 + x * 2, aliado.y + y, BLACK,
-		                     TETRIS[aliado.i][y][x], "  ");
+    /* Border */ // para pintar las paredes
+    for (y = 2 + posicion; y <= juego.alto; y+=4) {
+        putc(WELL_X - 1, y, BLACK, GRAY, ' ');
+        putc(WELL_RIGHT, y, BLACK, GRAY, ' ');
+    }
+}
 
-status:
+void draw_status(void)
+{
     if (paused)
         puts(STATUS_X + 2, STATUS_Y, BRIGHT | 1, BLACK, "PAUSED");
-    if (game_over)
+    if (juego.game_over)
         puts(STATUS_X, STATUS_Y, BRIGHT | RED, BLACK, "GAME OVER");
 
     /* Score */
     puts(SCORE_X + 6, SCORE_Y, GRAY, BLACK, "SCORE");
-    puts(SCORE_X  + 4, SCORE_Y + 2, BRIGHT | GRAY, BLACK, itoa(score, 10, 10));
+    puts(SCORE_X  + 4, SCORE_Y + 2, BRIGHT | GRAY, BLACK, itoa(juego.score, 10, 10));
 
     /* Level */
     puts(LEVEL_X + 6, LEVEL_Y, GRAY, BLACK, "LEVEL");
-    puts(LEVEL_X + 4, LEVEL_Y + 2, BRIGHT | GRAY, BLACK, itoa(level, 10, 10));
+    puts(LEVEL_X + 4, LEVEL_Y + 2, BRIGHT | GRAY, BLACK, itoa(juego.level, 10, 10));
 
     /* VIDAS */
     puts(VIDAS_X + 6, VIDAS_Y, GRAY, BLACK, "VIDAS");
-    puts(VIDAS_X  + 4, VIDAS_Y + 2, BRIGHT | GRAY, BLACK, itoa(vidas, 10, 10));
+    puts(VIDAS_X  + 4, VIDAS_Y + 2, BRIGHT | GRAY, BLACK, itoa(juego.vidas, 10, 10));
 }
 
-void draw2(int posicion) // position is a number from 0 to 3, for level 2
+void draw(int posicion) // position goes for 0 to 3, 
 {
     u8 x, y;
 
     if (paused) {
         draw_about();
-        goto status;
+        draw_status();
+        return;
     }
 
-    /* Border */ // para borrar las paredes que se mueven
-    for (y = 2; y <= WELL_HEIGHT; y++) {
-        putc(WELL_X - 1,            y, GRAY, BLACK, ' ');
-        putc(COLS / 2 + WELL_WIDTH, y, GRAY, BLACK, ' ');
+    draw_walls(posicion);
+    well_begin();
+
+    /* enemigo[lyd] */
+    for (int lyd = 0; lyd < 4; lyd++){
+    	if (juego.enemigo[lyd].existe == true)
+		    for (y = 0; y < 2; y++)
+		        for (x = 0; x < 3; x++)
+		            if (TETRIS[juego.enemigo[lyd].i][y][x])
+		                sprite(WELL_X + juego.enemigo[lyd].x * 2 + x * 2, juego.enemigo[lyd].y + y, BLACK,
+		                     TETRIS[juego.enemigo[lyd].i][y][x], "  ");
     }
 
-    /* Border */ // para pintar las paredes
-    for (y = 2 + posicion; y <= WELL_HEIGHT; y+=4) {
-        putc(WELL_X - 1,            y, BLACK, GRAY, ' ');
-        putc(COLS / 2 + WELL_WIDTH, y, BLACK, GRAY, ' ');
+    /* bala[lyd] */
+    for (int lyd = 0; lyd < 4; lyd++){
+    	if (juego.bala[lyd].existe == true)
+            sprite(WELL_X + juego.bala[lyd].x * 2, juego.bala[lyd].y, 4, BLACK, "ll");
     }
 
+    // aliado
+    if (juego.aliado.existe == true)
+	    for (y = 0; y < 2; y++)
+		        for (x = 0; x < 3; x++)
+		            if (TETRIS[juego.aliado.i][y][x])
+		                sprite(WELL_X + juego.aliado.x * 2 + x * 2, juego.aliado.y + y, BLACK,
+		                     TETRIS[juego.aliado.i][y][x], "  ");
+
+    // companero
+    if (juego.companero.existe == true)
+	    for (y = 0; y < 2; y++)
+		        for (x = 0; x < 3; x++)
+		            if (TETRIS[juego.companero.i][y][x])
+		                sprite(WELL_X + juego.companero.x * 2 + x * 2, juego.companero.y + y, BLACK,
+		                     TETRIS[juego.companero.i][y][x], "  ");
+
+    draw_status();
+}
+
+void draw2(int posicion) // position is a number from 0 to 3, for level 2
+{
+    u8 x, y;
 
-    for (x = 1; x < WELL_WIDTH * 2 + 1; x++)
-        putc(WELL_X + x - 1, WELL_HEIGHT, BRIGHT, BLACK, ':');// para pintar la fila de abajo
+    if (paused) {
+        draw_about();
+        draw_status();
+        return;
+    }
 
-    /* Well */
-    for (y = 0; y < 2; y++)
-        for (x = 0; x < WELL_WIDTH; x++)
-            puts(WELL_X + x * 2, y, BLACK, BLACK, "  ");
-    for (y = 2; y < WELL_HEIGHT; y++)
-        for (x = 0; x < WELL_WIDTH; x++)
-			puts(WELL_X + x * 2, y, BRIGHT, BLACK, "::");
+    draw_walls(posicion);
+    well_begin();
 
     // aliado
-    if (aliado.existe == true)
+    if (juego.aliado.existe == true)
 	    for (y = 0; y < 2; y++)
 		        for (x = 0; x < 3; x++)
-		            if (TETRIS[aliado.i][y][x])
-		                puts(WELL_X + aliado.x * 2 + x * 2, aliado.y + y, BLACK,
-		                     TETRIS[aliado.i][y][x], "  ");
+		            if (TETRIS[juego.aliado.i][y][x])
+		                sprite(WELL_X + juego.aliado.x * 2 + x * 2, juego.aliado.y + y, BLACK,
+		                     TETRIS[juego.aliado.i][y][x], "  ");
 
 	/* Rocas */
-    for (int lyd = 0; lyd < 4; lyd++){
-    	if (rocas[lyd].existe == true)
-            puts(WELL_X + rocas[lyd].x * 2, rocas[lyd].y, 4, 4, "  ");
+    for (int lyd = 0; lyd < 3; lyd++){
+    	if (juego.rocas[lyd].existe == true)
+            sprite(WELL_X + juego.rocas[lyd].x * 2, juego.rocas[lyd].y, 4, 4, "  ");
     }
 
-	u32 temp = WELL_HEIGHT;
+	u32 temp = juego.alto;
 
-	for (x = 0; x < 19; x++){
-		puts(WELL_X + position[x] * 2, temp, BLACK, GRAY, "  ");
-		puts(WELL_X + (position[x] * 2) + 11*2, temp, BLACK, GRAY, "  ");
+	for (x = 0; x < juego.alto - 1; x++){
+		sprite(WELL_X + juego.position[x] * 2, temp, BLACK, GRAY, "  ");
+		sprite(WELL_X + (juego.position[x] * 2) + 11*2, temp, BLACK, GRAY, "  ");
 		temp -= 1;
 	} 
 
-status:
-    if (paused)
-        puts(STATUS_X + 2, STATUS_Y, BRIGHT | 1, BLACK, "PAUSED");
-    if (game_over)
-        puts(STATUS_X, STATUS_Y, BRIGHT | RED, BLACK, "GAME OVER");
+    draw_status();
+}
 
-    /* Score */
-    puts(SCORE_X + 6, SCORE_Y, GRAY, BLACK, "SCORE");
-    puts(SCORE_X  + 4, SCORE_Y + 2, BRIGHT | GRAY, BLACK, itoa(score, 10, 10));
+/* Netplay */
+
+/* Two instances play level 1 together over COM2 (COM1 is for logging). The
+ * simulation advances in fixed ticks of NET_TICK_MS driven only by the inputs
+ * of both players, so both sides compute the same game. Local input is
+ * scheduled NET_INPUT_DELAY ticks ahead and sent to the peer as a small
+ * packet. When the peer's input for a tick is not known yet it is predicted as
+ * "no input"; if the real input turns out different, the game state is rolled
+ * back to the snapshot taken before that tick and the ticks since are
+ * simulated again. */
+
+#define NET_PORT (COM2)
+
+#define NET_MAGIC (0xA5)
+#define NET_HELLO (1 << 0) /* packet flag: sent while waiting for the peer */
+#define NET_PACKET_SIZE (8)
+
+/* Number of ticks of inputs and snapshots kept. Must cover the ticks that can
+ * be in flight between the two sides. */
+#define NET_WINDOW (32)
+_Static_assert(2 * (NET_MAX_AHEAD + NET_INPUT_DELAY) < NET_WINDOW,
+               "NET_WINDOW too small for NET_MAX_AHEAD and NET_INPUT_DELAY");
+
+#define NET_NONE (0xFFFFFFFF)
+
+u8 net_player;                    /* 0 drives aliado, 1 drives companero */
+u32 net_tick;                     /* next tick to simulate */
+u32 net_confirmed;                /* remote input is known for all ticks before this */
+u32 net_rollback_from;            /* earliest tick simulated with a wrong prediction */
+u8 net_pending;                   /* local input since the last tick */
+
+u8 net_local[NET_WINDOW];         /* local input, by tick */
+u8 net_remote[NET_WINDOW];        /* remote input, by tick */
+u32 net_remote_tick[NET_WINDOW];  /* tick held in each slot of net_remote */
+u8 net_used[NET_WINDOW];          /* remote input the tick was simulated with */
+struct juego net_saved[NET_WINDOW]; /* game before each tick */
+u64 net_sent_at[NET_WINDOW];      /* rdtsc when the input for a tick was sent */
+u32 net_acked;                    /* latest of our ticks the peer confirmed */
+
+u8 net_rx[NET_PACKET_SIZE], net_rx_len;
+u8 net_tx[4 * NET_PACKET_SIZE], net_tx_head, net_tx_tail;
+
+/* Statistics, shown next to the well. */
+u32 net_rollbacks, net_resim, net_resim_per_sec, net_rtt_ms;
+u32 net_stats_since;
+
+/* Return the number of bytes free in the transmit queue. */
+u8 net_tx_room(void)
+{
+    return (net_tx_tail - net_tx_head - 1 + sizeof(net_tx)) % sizeof(net_tx);
+}
 
-    /* Level */
-    puts(LEVEL_X + 6, LEVEL_Y, GRAY, BLACK, "LEVEL");
-    puts(LEVEL_X + 4, LEVEL_Y + 2, BRIGHT | GRAY, BLACK, itoa(level, 10, 10));
+/* Queue a packet carrying the local input for tick, and the one before it in
+ * case a packet is lost. If the queue has no room for the whole packet, as
+ * when the peer is gone, the packet is dropped. */
+void net_send(u32 tick, u8 flags)
+{
+    u8 p[NET_PACKET_SIZE];
+    u32 ack = net_confirmed - 1;
+    p[0] = NET_MAGIC;
+    p[1] = tick & 0xFF;
+    p[2] = (tick >> 8) & 0xFF;
+    p[3] = net_local[tick % NET_WINDOW] | (net_local[(tick - 1) % NET_WINDOW] << 4);
+    p[4] = ack & 0xFF;
+    p[5] = (ack >> 8) & 0xFF;
+    p[6] = flags;
+    p[7] = 0;
+    for (u8 i = 0; i < NET_PACKET_SIZE - 1; i++)
+        p[7] += p[i];
+
+    if (net_tx_room() < NET_PACKET_SIZE)
+        return;
+    for (u8 i = 0; i < NET_PACKET_SIZE; i++) {
+        net_tx[net_tx_head] = p[i];
+        net_tx_head = (net_tx_head + 1) % sizeof(net_tx);
+    }
+}
 
-    /* VIDAS */
-    puts(VIDAS_X + 6, VIDAS_Y, GRAY, BLACK, "VIDAS");
-    puts(VIDAS_X  + 4, VIDAS_Y + 2, BRIGHT | GRAY, BLACK, itoa(vidas, 10, 10));
+/* Send again the inputs the peer has not confirmed, oldest first, as many as
+ * fit in the queue. Both peers stall for good if the packets that would let
+ * them advance are lost, so this runs while net_advance is waiting. */
+void net_resend(void)
+{
+    u32 last = net_tick + NET_INPUT_DELAY - 1; /* latest input sent */
+
+    for (u32 tick = net_acked + 2; tick <= last + 1; tick += 2) {
+        if (net_tx_room() < NET_PACKET_SIZE)
+            break;
+        net_send(tick <= last ? tick : last, 0);
+    }
 }
 
-int pos = 0;
+/* Extend a 16-bit tick from a packet to the full tick closest to near. */
+u32 net_unwrap(u16 tick, u32 near)
+{
+    return near + (s16) (tick - (u16) near);
+}
 
-noreturn kernel_main()
+/* Record the remote input for tick, and schedule a rollback if that tick was
+ * already simulated with a different prediction. */
+void net_receive_input(u32 tick, u8 input)
 {
+    u8 slot = tick % NET_WINDOW;
+    if (tick < net_confirmed || tick >= net_confirmed + NET_WINDOW)
+        return;
+    if (net_remote_tick[slot] == tick)
+        return;
+    net_remote[slot] = input;
+    net_remote_tick[slot] = tick;
+    if (tick < net_tick && net_used[slot] != input && tick < net_rollback_from)
+        net_rollback_from = tick;
+    while (net_remote_tick[net_confirmed % NET_WINDOW] == net_confirmed)
+        net_confirmed++;
+}
 
-loop0:
+/* Handle a complete packet in net_rx. Return true if it was valid. */
+bool net_receive(void)
+{
+    u8 sum = 0;
+    for (u8 i = 0; i < NET_PACKET_SIZE - 1; i++)
+        sum += net_rx[i];
+    if (sum != net_rx[7])
+        return false;
 
-    clear(BLACK);
-    draw_about();
-    inicializar();
+    u32 tick = net_unwrap(net_rx[1] | (net_rx[2] << 8), net_confirmed);
+    u32 ack = net_unwrap(net_rx[4] | (net_rx[5] << 8), net_acked);
+    if (net_rx[6] & NET_HELLO)
+        return true;
+
+    net_receive_input(tick - 1, net_rx[3] >> 4);
+    net_receive_input(tick, net_rx[3] & 0x0F);
+    if (ack > net_acked && ack < net_tick + NET_INPUT_DELAY) {
+        net_acked = ack;
+        u64 span = rdtsc() - net_sent_at[ack % NET_WINDOW];
+        net_rtt_ms = tpms ? (u32) div64(span, (u32) tpms) : 0;
+    }
+    return true;
+}
+
+/* Move bytes between the UART and the packet buffers without waiting. Return
+ * true if a valid packet was received. */
+bool net_poll(void)
+{
+    bool received = false;
+
+    if (net_tx_tail != net_tx_head && serial_empty(NET_PORT))
+        for (u8 i = 0; i < 16 && net_tx_tail != net_tx_head; i++) {
+            outb(NET_PORT, net_tx[net_tx_tail]);
+            net_tx_tail = (net_tx_tail + 1) % sizeof(net_tx);
+        }
 
-    u8 key;
-    u8 last_key;
+    while (serial_received(NET_PORT)) {
+        u8 byte = inb(NET_PORT);
+        if (!net_rx_len && byte != NET_MAGIC)
+            continue; /* resynchronize on the next packet */
+        net_rx[net_rx_len++] = byte;
+        if (net_rx_len == NET_PACKET_SIZE) {
+            net_rx_len = 0;
+            if (net_receive())
+                received = true;
+        }
+    }
 
-    // wait for enter to start the game
-    while (1){
-    	if ((key=scan())){
-    		if (key == KEY_P) break;
-    	}
+    if (pit_ticks - net_stats_since >= PIT_HZ) {
+        net_stats_since = pit_ticks;
+        net_resim_per_sec = net_resim;
+        net_resim = 0;
     }
+    return received;
+}
 
-    /* Wait a full second to calibrate timing. */
-    u32 itpms;
-    tps();
-    itpms = tpms; while (tpms == itpms) tps();
-    itpms = tpms; while (tpms == itpms) tps();
+/* Simulate tick with the known or predicted inputs of both players. */
+void net_simulate(u32 tick)
+{
+    u8 slot = tick % NET_WINDOW;
+    u8 remote = net_remote_tick[slot] == tick ? net_remote[slot] : 0;
+    u8 input[2];
+
+    net_used[slot] = remote;
+    input[net_player] = net_local[slot];
+    input[!net_player] = remote;
+
+    juego_tick(&juego, input[0], input[1], speed / NET_TICK_MS);
+}
+
+/* Restore the state before the earliest mispredicted tick and simulate up to
+ * the current tick again. Return true if a rollback happened. */
+bool net_rollback(void)
+{
+    if (net_rollback_from == NET_NONE)
+        return false;
+    u32 tick = net_rollback_from;
+    net_rollback_from = NET_NONE;
+
+    /* Sounds of the replayed ticks were already heard. */
+    u8 sonidos = juego.sonidos;
+    juego_restaurar(&juego, &net_saved[tick % NET_WINDOW]);
+    for (; tick < net_tick; tick++) {
+        net_saved[tick % NET_WINDOW] = juego;
+        net_simulate(tick);
+        net_resim++;
+    }
+    juego.sonidos = sonidos;
+    net_rollbacks++;
+    return true;
+}
+
+/* Run the next tick if it is due, unless the peer has fallen too far behind,
+ * in which case the inputs it may be missing are sent again. Return true if a
+ * tick was simulated. */
+bool net_advance(void)
+{
+    if (!interval(TIMER_NET, NET_TICK_MS))
+        return false;
+    if (net_tick - net_confirmed >= NET_MAX_AHEAD) {
+        net_resend();
+        return false;
+    }
+
+    u32 tick = net_tick + NET_INPUT_DELAY;
+    net_local[tick % NET_WINDOW] = net_pending;
+    net_pending = 0;
+    net_send(tick, 0);
+    net_sent_at[tick % NET_WINDOW] = rdtsc();
+
+    net_saved[net_tick % NET_WINDOW] = juego;
+    net_simulate(net_tick++);
+    return true;
+}
+
+/* Reset the netcode for a new game. The inputs of the first NET_INPUT_DELAY
+ * ticks are empty on both sides. */
+void net_reset(void)
+{
+    net_tick = 0;
+    net_confirmed = NET_INPUT_DELAY;
+    net_acked = NET_INPUT_DELAY - 1;
+    net_rollback_from = NET_NONE;
+    net_pending = 0;
+    net_rx_len = 0;
+    net_rollbacks = net_resim = net_resim_per_sec = net_rtt_ms = 0;
+    for (u8 i = 0; i < NET_WINDOW; i++) {
+        net_local[i] = net_remote[i] = 0;
+        net_remote_tick[i] = i < NET_INPUT_DELAY ? i : NET_NONE;
+    }
+}
+
+/* Wait until a packet arrives from the peer, announcing ourselves every 100
+ * milliseconds meanwhile. */
+void net_handshake(void)
+{
+    puts(1, 20, BRIGHT | GRAY, BLACK, "PLAYER");
+    puts(8, 20, BRIGHT | GRAY, BLACK, itoa(net_player + 1, 10, 1));
+    puts(1, 21, GRAY, BLACK, "Waiting for peer...");
+    present();
+    while (!net_poll()) {
+        tps();
+        if (interval(TIMER_NET, 100))
+            net_send(net_tick, NET_HELLO);
+    }
+    net_send(net_tick, NET_HELLO);
+    puts(1, 21, GRAY, BLACK, "                   ");
+}
+
+/* Draw the netplay statistics below the controls. */
+void draw_net(void)
+{
+    puts(1, 20, BRIGHT | GRAY, BLACK, "PLAYER");
+    puts(8, 20, BRIGHT | GRAY, BLACK, itoa(net_player + 1, 10, 1));
+    puts(1, 21, GRAY, BLACK, "Rollbacks");
+    puts(12, 21, BRIGHT | GRAY, BLACK, itoa(net_rollbacks, 10, 6));
+    puts(1, 22, GRAY, BLACK, "Resim/s");
+    puts(12, 22, BRIGHT | GRAY, BLACK, itoa(net_resim_per_sec, 10, 6));
+    puts(1, 23, GRAY, BLACK, "RTT ms");
+    puts(12, 23, BRIGHT | GRAY, BLACK, itoa(net_rtt_ms, 10, 6));
+}
+
+/* Benchmark */
+
+#ifdef __x86_64__
+#define ARCH "x86-64"
+#else
+#define ARCH "i386"
+#endif
+
+/* Number of game ticks and frames to time, as powers of two so the averages
+ * are shifts rather than 64-bit divisions. */
+#define BENCH_TICKS_LOG2  (14)
+#define BENCH_FRAMES_LOG2 (10)
+#define BENCH_KERNELS_LOG2 (12)
+#define BENCH_LOG_LOG2 (7)
+
+void bench_report(const char *name, u64 total, u8 log2)
+{
+    u32 cycles = (u32) (total >> log2);
+    debugcon_puts(ARCH " ");
+    debugcon_puts(name);
+    debugcon_puts(" cycles=");
+    debugcon_puts(itoa(cycles, 10, 1));
+    debugcon_puts(" ns=");
+    debugcon_puts(itoa(tpms ? (u32) div64((u64) cycles * 1000000, (u32) tpms) : 0,
+                       10, 1));
+    debugcon_puts("\n");
+}
 
-    /* Initialize game state. Shuffle bag of tetriminos until first tetrimino
-     * is not S or Z. */
-    //do { shuffle(bag, BAG_SIZE); } while (bag[0] == 4 || bag[0] == 6);
-    spawn();
+/* Time each vector kernel on a whole screen of cells in the current mode.
+ * The diff compares two buffers that differ in every 16th cell, so neither
+ * version can stop early. */
+void bench_kernels(const char *variant,
+                   void (*fill)(u16 *, u16, usize),
+                   void (*copy)(u16 *, const u16 *, usize),
+                   bool (*diff)(const u16 *, const u16 *, usize, u8 *))
+{
+    static u16 a[MAX_ROWS * MAX_COLS], b[MAX_ROWS * MAX_COLS];
+    u16 n = rows * cols;
+    u64 start, t;
+
+    debugcon_puts(ARCH " kernels=");
+    debugcon_puts(variant);
+    debugcon_puts("\n");
+
+    start = rdtsc();
+    for (u32 i = 0; i < (1 << BENCH_KERNELS_LOG2); i++)
+        fill(a, i, n);
+    t = rdtsc() - start;
+    bench_report("fill", t, BENCH_KERNELS_LOG2);
+
+    start = rdtsc();
+    for (u32 i = 0; i < (1 << BENCH_KERNELS_LOG2); i++)
+        copy(b, a, n);
+    t = rdtsc() - start;
+    bench_report("copy", t, BENCH_KERNELS_LOG2);
+
+    for (u32 i = 0; i < n; i += 16)
+        b[i]++;
+    start = rdtsc();
+    for (u32 i = 0; i < (1 << BENCH_KERNELS_LOG2); i++)
+        diff(a, b, n, changed);
+    t = rdtsc() - start;
+    bench_report("diff", t, BENCH_KERNELS_LOG2);
+}
+
+/* Time the level 1 simulation step and draw() on a scripted game, report the
+ * average cost of each, and of the vector kernels, on the debug console and
+ * leave QEMU. Selected with "bench" on the kernel command line, to compare the
+ * i386 and x86-64 builds (make bench). */
+noreturn benchmark(void)
+{
     clear(BLACK);
-    draw(pos);
+    calibrate();
+    juego_nuevo(&juego);
+    spawn(&juego);
+
+    u64 start = rdtsc();
+    for (u32 i = 0; i < (1 << BENCH_TICKS_LOG2); i++) {
+        move_bichito(&juego, i & 8 ? 1 : -1, 0);
+        if (!(i & 3))
+            disparar(&juego);
+        update(&juego);
+        check_collisions(&juego);
+        juego_resolver(&juego);
+        if (juego.vidas == 0)
+            juego.vidas = juego.reglas.vidas;
+    }
+    u64 ticks = rdtsc() - start;
 
-loop:	
+    start = rdtsc();
+    for (u32 i = 0; i < (1 << BENCH_FRAMES_LOG2); i++) {
+        draw(i & 3);
+        present();
+    }
+    u64 frames = rdtsc() - start;
+
+    bench_report("tick", ticks, BENCH_TICKS_LOG2);
+    bench_report("draw", frames, BENCH_FRAMES_LOG2);
+
+    /* a log line, from the caller's side: formatting and queueing it */
+    bool was_logging = logging;
+    logging = true;
+    start = rdtsc();
+    for (u32 i = 0; i < (1 << BENCH_LOG_LOG2); i++)
+        klog("bench %u", i);
+    u64 lines = rdtsc() - start;
+    logging = was_logging;
+    bench_report("log", lines, BENCH_LOG_LOG2);
+
+    bench_kernels("scalar", fill16_scalar, copy16_scalar, diff16_scalar);
+    if (sse2_usable())
+        bench_kernels("sse2", fill16_sse2, copy16_sse2, diff16_sse2);
+    qemu_exit(0);
+    reset();
+}
 
-    tps();
+/* Boot Trace */
 
-    puts(1, 16, BRIGHT | GRAY, BLACK, "SPACE");
-    puts(7, 16, GRAY,          BLACK, "- Shoot");
-    puts(1, 17, BRIGHT | GRAY, BLACK, "P");
-    puts(7, 17, GRAY,          BLACK, "- Pause");
-    puts(1, 18, BRIGHT | GRAY, BLACK, "R");
-    puts(7, 18, GRAY,          BLACK, "- Reset");
+bool boot_tracing = false; /* "boottrace" on the kernel command line */
 
-    bool updated = false;
+/* Once every boot stage was reached and tpms is known, print when each was
+ * reached on the debug console and leave QEMU, for boottime.sh to average
+ * over many boots. Stages are in microseconds since _start, and start is
+ * since the processor was reset, which covers the firmware and the
+ * bootloader. Called on every iteration of the main loop. */
+void boot_trace(void)
+{
+    if (!boot_tracing)
+        return;
+    for (u8 i = 0; i < BOOT__LENGTH; i++)
+        if (!boot_stages[i])
+            return;
+    boot_tracing = false;
+
+    char line[LOG_LINE];
+    format(line, LOG_LINE,
+           ARCH " boot start=%u main=%u clear=%u frame=%u calibrated=%u\n",
+           tsc_us(boot_tsc), tsc_us(boot_stages[BOOT_MAIN] - boot_tsc),
+           tsc_us(boot_stages[BOOT_CLEAR] - boot_tsc),
+           tsc_us(boot_stages[BOOT_FRAME] - boot_tsc),
+           tsc_us(boot_stages[BOOT_CALIBRATED] - boot_tsc));
+    debugcon_puts(line);
+    qemu_exit(0);
+}
 
-    if ((key = scan())) {
-        last_key = key;
-        switch(key) {
-        case KEY_R:
-            reset();
-        case KEY_LEFT:
-            move_bichito(-1, 0);
-            break;
-        case KEY_RIGHT:
-            move_bichito(1, 0);
-            break;
-        case KEY_SPACE:
-            disparar();
-            break;
-        case KEY_P:
-            if (game_over)
-                break;
-            clear(BLACK);
-            paused = !paused;
-            break;
+/* Memory Report */
+
+/* Section bounds exported by linker.ld, and the stack from boot.S, which
+ * _start fills with STACK_CANARY before using it. */
+extern u8 __text_start[], __text_end[], __rodata_start[], __rodata_end[];
+extern u8 __data_start[], __data_end[], __bss_start[], __bss_end[];
+extern u8 stack_bottom[], stack_top[];
+
+#define STACK_CANARY (0x57AC57AC) /* as in boot.S */
+
+/* The biggest statically allocated objects. */
+struct footprint {
+    const char *name;
+    u32 size;
+};
+
+#define FOOTPRINT(x) {#x, sizeof(x)}
+const struct footprint footprints[] = {
+    FOOTPRINT(net_saved),
+    FOOTPRINT(juego),
+    FOOTPRINT(campo),
+    FOOTPRINT(video),
+    FOOTPRINT(shown),
+    FOOTPRINT(uart_tx),
+    FOOTPRINT(disk_queue),
+    FOOTPRINT(sprites),
+    FOOTPRINT(idt),
+};
+#undef FOOTPRINT
+
+/* Bytes of the stack used at its deepest so far, interrupts included: the
+ * distance from the top to the lowest word that is not the canary. */
+u32 stack_used(void)
+{
+    const u32 *w = (const u32 *) stack_bottom;
+    while (w < (const u32 *) stack_top && *w == STACK_CANARY)
+        w++;
+    return stack_top - (const u8 *) w;
+}
+
+/* Print the section sizes, the stack use and the footprints through print,
+ * one line per call. .bss includes the stack. */
+void mem_report(void (*print)(const char *fmt, ...))
+{
+    print("text %u rodata %u data %u bss %u bytes",
+          (u32) (__text_end - __text_start), (u32) (__rodata_end - __rodata_start),
+          (u32) (__data_end - __data_start), (u32) (__bss_end - __bss_start));
+    print("stack %u of %u bytes used at most", stack_used(),
+          (u32) (stack_top - stack_bottom));
+    for (u8 i = 0; i < sizeof(footprints) / sizeof(footprints[0]); i++)
+        print("%s %u bytes", footprints[i].name, footprints[i].size);
+}
+
+/* Scenes */
+
+/* The game is a stack of scenes (title, levels, the screens between them and
+ * the pause screen) and only the one on top runs. scene_run owns the main
+ * loop: it reads the keyboard, runs the top scene's ticks, and draws the scene
+ * only when one of its hooks reports a change (see the frame governor below).
+ * Static scenes only change on input, so once drawn the CPU sleeps in hlt
+ * until the next interrupt instead of redrawing the same screen over and
+ * over. */
+
+struct scene {
+    const char *name;        /* for the log */
+    void (*enter)(void);     /* on becoming the top scene */
+    bool (*input)(u8 key);   /* on a key press; return true to redraw */
+    bool (*poll)(void);      /* on every iteration; return true to redraw */
+    bool (*tick)(void);      /* every *period ms; return true to redraw */
+    const u32 *period;
+    void (*draw)(void);
+    void (*exit)(void);      /* on being replaced or popped */
+    bool is_static;          /* nothing changes without input */
+};
+
+const struct scene scene_title, scene_level1, scene_level2, scene_transition,
+                   scene_game_over, scene_pause, scene_netplay;
+
+/* Frame Governor */
+
+/* The top scene is simulated at its own period and drawn at most once per
+ * display frame of frame_ms. Ticks are scheduled on the TSC rather than after
+ * the last one ran, so a slow frame delays the next ticks but does not lose
+ * them: the ticks that are due run back to back without drawing in between,
+ * and one frame is drawn after them. After max_catchup ticks in a row it
+ * gives up on the rest, as then the simulation alone is too slow to keep up.
+ * Redraws asked for between frames (by ticks or key presses) are folded into
+ * the next frame and counted as skipped. */
+
+u32 frame_ms = FRAME_MS;
+u32 max_catchup = MAX_CATCHUP;
+bool show_stats = false; /* "stats" on the kernel command line */
+
+struct governor {
+    u64 next_tick;      /* when the next tick is due, 0 to start over */
+    u64 last_frame;     /* when the last frame was drawn */
+    bool pending;       /* the top scene changed since the last frame */
+    u32 frames;         /* frames drawn */
+    u32 skipped;        /* redraws folded into a later frame */
+    u32 dropped;        /* times catching up was given up */
+    u32 ticks;          /* ticks run */
+    u32 tick_cycles;    /* cost of the last tick */
+    u32 frame_cycles;   /* cost of the last frame, draw and present */
+    u32 fps;            /* frames drawn in the last second */
+    u32 second;         /* pit_ticks and frames when fps was last updated */
+    u32 second_frames;
+} gov;
+
+/* Ask for the top scene to be drawn in the next frame. */
+void gov_redraw(void)
+{
+    if (gov.pending)
+        gov.skipped++;
+    gov.pending = true;
+}
+
+/* Microseconds in c CPU ticks. */
+u32 cycles_us(u32 c)
+{
+    u32 tpus = (u32) tpms / 1000;
+    return tpus ? c / tpus : 0;
+}
+
+/* Governor statistics on the last row. */
+void draw_stats(void)
+{
+    u8 y = rows - 1;
+    puts(1,  y, GRAY,          BLACK, "FPS");
+    puts(5,  y, BRIGHT | GRAY, BLACK, itoa(gov.fps, 10, 3));
+    puts(10, y, GRAY,          BLACK, "SKIP");
+    puts(15, y, BRIGHT | GRAY, BLACK, itoa(gov.skipped, 10, 6));
+    puts(23, y, GRAY,          BLACK, "TICK");
+    puts(28, y, BRIGHT | GRAY, BLACK, itoa(cycles_us(gov.tick_cycles), 10, 5));
+    puts(33, y, GRAY,          BLACK, "us");
+    puts(37, y, GRAY,          BLACK, "DRAW");
+    puts(42, y, BRIGHT | GRAY, BLACK, itoa(cycles_us(gov.frame_cycles), 10, 5));
+    puts(47, y, GRAY,          BLACK, "us");
+}
+
+/* Tunables Console */
+
+/* With "console" on the kernel command line, COM1 also takes commands (make
+ * console): list and set the tunables below without rebuilding, and dump the
+ * performance counters. A set value is staged and applied by tunables_apply
+ * at the top of the main loop, between two ticks, so no tick sees half of a
+ * change. The game rules apply to the game in progress; lives to the next
+ * one. Type help for the commands. */
+
+enum tunable_type {
+    TUNABLE_U32,
+    TUNABLE_BOOL
+};
+
+struct tunable {
+    const char *name;
+    enum tunable_type type;
+    void *value;        /* u32 or bool */
+    u32 min, max;
+    const char *help;
+};
+
+const struct tunable tunables[] = {
+    {"speed",        TUNABLE_U32,  &speed,                      10, 2000,
+     "ms between game ticks"},
+    {"frame_ms",     TUNABLE_U32,  &frame_ms,                   1, 1000,
+     "ms between frames, at least"},
+    {"catchup",      TUNABLE_U32,  &max_catchup,                1, 100,
+     "late ticks run back to back before the rest are dropped"},
+    {"level2_score", TUNABLE_U32,  &juego.reglas.puntos_nivel2, 1, 10000,
+     "score that moves the game to level 2"},
+    {"win_score",    TUNABLE_U32,  &juego.reglas.puntos_fin,    1, 10000,
+     "score that wins level 2"},
+    {"lives",        TUNABLE_U32,  &juego.reglas.vidas,         1, 99,
+     "lives at the start of a game"},
+    {"hit_points",   TUNABLE_U32,  &juego.reglas.puntos_hit,    0, 255,
+     "points for shooting an enemy"},
+    {"rock_points",  TUNABLE_U32,  &juego.reglas.puntos_roca,   0, 255,
+     "points for a rock getting past the bottom"},
+    {"enemies",      TUNABLE_U32,  &juego.reglas.enemigos,      0, 4,
+     "most enemies at once"},
+    {"spawn_every",  TUNABLE_U32,  &juego.reglas.spawn_cada,    1, 1000,
+     "updates between enemy spawns"},
+    {"log",          TUNABLE_BOOL, &logging,                    0, 1,
+     "log events to COM1"},
+};
+
+#define TUNABLES (sizeof(tunables) / sizeof(tunables[0]))
+_Static_assert(TUNABLES <= 32, "tunable_staged has one bit per tunable");
+
+u32 tunable_staged[TUNABLES]; /* values waiting for tunables_apply */
+u32 tunable_dirty = 0;        /* bit i set if tunables[i] has one */
+
+bool console = false;
+#define CONSOLE_LINE (64)
+char console_line[CONSOLE_LINE];
+u8 console_len = 0;
+
+u32 tunable_get(const struct tunable *t)
+{
+    return t->type == TUNABLE_BOOL ? *(bool *) t->value : *(u32 *) t->value;
+}
+
+/* Apply the staged values. Called between ticks. */
+void tunables_apply(void)
+{
+    if (!tunable_dirty)
+        return;
+    for (u8 i = 0; i < TUNABLES; i++) {
+        if (!(tunable_dirty & (1u << i)))
+            continue;
+        const struct tunable *t = &tunables[i];
+        if (t->type == TUNABLE_BOOL)
+            *(bool *) t->value = tunable_staged[i] ? true : false;
+        else
+            *(u32 *) t->value = tunable_staged[i];
+        klog("tunable %s = %u", t->name, tunable_staged[i]);
+    }
+    tunable_dirty = 0;
+    gov.next_tick = 0; /* a new speed counts from now */
+}
+
+/* Write a line to the console. */
+void console_print(const char *fmt, ...)
+{
+    char line[LOG_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    usize n = vformat(line, LOG_LINE - 1, fmt, ap);
+    va_end(ap);
+    line[n++] = '\n';
+    uart_write(line, n);
+}
+
+/* Split the next word off the line at *s. Return 0 at the end of the line. */
+char *console_word(char **s)
+{
+    char *c = *s;
+    while (*c == ' ')
+        c++;
+    if (!*c)
+        return 0;
+    char *word = c;
+    while (*c && *c != ' ')
+        c++;
+    if (*c)
+        *c++ = 0;
+    *s = c;
+    return word;
+}
+
+/* Return the index of the tunable called name, or -1. */
+s8 tunable_find(const char *name)
+{
+    for (u8 i = 0; i < TUNABLES; i++)
+        if (streq(tunables[i].name, name))
+            return i;
+    console_print("no tunable %s, try list", name);
+    return -1;
+}
+
+void console_show(u8 i)
+{
+    const struct tunable *t = &tunables[i];
+    if (tunable_dirty & (1u << i))
+        console_print("%s = %u, %u next tick (%u-%u) %s", t->name, tunable_get(t),
+                      tunable_staged[i], t->min, t->max, t->help);
+    else
+        console_print("%s = %u (%u-%u) %s", t->name, tunable_get(t), t->min,
+                      t->max, t->help);
+}
+
+void console_set(const char *name, const char *value)
+{
+    s8 i = tunable_find(name);
+    if (i < 0)
+        return;
+    const struct tunable *t = &tunables[i];
+    if (!value || *value < '0' || *value > '9') {
+        console_print("usage: set %s %u-%u", t->name, t->min, t->max);
+        return;
+    }
+    u32 v = atou(value);
+    if (v < t->min || v > t->max) {
+        console_print("%s must be %u-%u", t->name, t->min, t->max);
+        return;
+    }
+    if (netplay) {
+        console_print("not during netplay, the other side would not follow");
+        return;
+    }
+    tunable_staged[i] = v;
+    tunable_dirty |= 1u << i;
+    console_show(i);
+}
+
+/* Counters of the frame governor, the log, the game, the disk and netplay. */
+void console_perf(void)
+{
+    console_print("uptime %u ms, %u cpu ticks/ms", pit_ticks, (u32) tpms);
+    console_print("frames %u, %u fps, %u skipped, %u catch-ups dropped",
+                  gov.frames, gov.fps, gov.skipped, gov.dropped);
+    console_print("last tick %u us, last frame %u us",
+                  cycles_us(gov.tick_cycles), cycles_us(gov.frame_cycles));
+    console_print("log: %u lines dropped, %u bytes", uart_dropped,
+                  uart_dropped_bytes);
+    console_print("game: update %u, score %u, %u events lost", juego.updates,
+                  juego.score, juego.eventos_perdidos);
+    console_print("disk: %u written, %u failed, %u queued", disk_writes,
+                  disk_errors, disk_count);
+    if (netplay)
+        console_print("net: %u rollbacks, %u ticks resimulated, rtt %u ms",
+                      net_rollbacks, net_resim, net_rtt_ms);
+}
+
+void console_run(char *line)
+{
+    char *cmd = console_word(&line);
+    if (!cmd)
+        return;
+    if (streq(cmd, "help")) {
+        console_print("list            all tunables");
+        console_print("get NAME        one tunable");
+        console_print("set NAME VALUE  change a tunable from the next tick");
+        console_print("perf            performance counters");
+        console_print("mem             section sizes and stack use");
+    } else if (streq(cmd, "list")) {
+        for (u8 i = 0; i < TUNABLES; i++)
+            console_show(i);
+    } else if (streq(cmd, "get")) {
+        char *name = console_word(&line);
+        s8 i = name ? tunable_find(name) : -1;
+        if (i >= 0)
+            console_show(i);
+    } else if (streq(cmd, "set")) {
+        char *name = console_word(&line);
+        if (name)
+            console_set(name, console_word(&line));
+        else
+            console_print("usage: set NAME VALUE");
+    } else if (streq(cmd, "perf"))
+        console_perf();
+    else if (streq(cmd, "mem"))
+        mem_report(console_print);
+    else
+        console_print("unknown command %s, try help", cmd);
+}
+
+/* Take the bytes received on COM1 without waiting, echoing them, and run
+ * each complete line. */
+void console_poll(void)
+{
+    if (!console)
+        return;
+    while (serial_received(COM1)) {
+        char c = inb(COM1);
+        if (c == '\r' || c == '\n') {
+            uart_write("\n", 1);
+            console_line[console_len] = 0;
+            console_len = 0;
+            console_run(console_line);
+            uart_write("> ", 2);
+        } else if ((c == '\b' || c == 0x7F) && console_len) {
+            console_len--;
+            uart_write("\b \b", 3);
+        } else if (c >= ' ' && c < 0x7F && console_len < CONSOLE_LINE - 1) {
+            console_line[console_len++] = c;
+            uart_write(&c, 1);
         }
-        updated = true;
     }
+}
 
-    if (!paused && !game_over && interval(TIMER_UPDATE, speed)) {
-        update();
-        updated = true;
-        if (pos < 4) {
-    		pos++;
-	    }
-	    if (pos == 4) {
-	    	pos = 0;
-	    }
-    }
-
-    if (updated) {
-        draw(pos);
-        check_collisions();
-        check_level_change();
-        check_game_over();
-        if (game_over){
-			clear(BLACK);
-			goto loop2;
-		}
-		if (level2 == true){
-			clear(BLACK);
-			goto loop4;
-		}
-    }
-
-    goto loop;
-
-loop2:
-	draw_game_over();
-
-	if ((key=scan())){
-		if (key == KEY_P){ 
-			vidas = 3;
-			score = 0;
-			level = 1;
-			game_over = false;
-			level2 = false;
-			goto loop0;
-		}
-	}
-	
-
-	goto loop2;
-
-loop3:
-
-
-    puts(1, 17, BRIGHT | GRAY, BLACK, "P");
-    puts(7, 17, GRAY,          BLACK, "- Pause");
+/* Autoplayer */
+
+/* With "bot" on the kernel command line the game plays itself, for soak
+ * tests and benchmarks of whole sessions: bot_key stands in for the keyboard,
+ * pressing P through the screens between games and steering in the levels
+ * from the state of the game, at most one key every quarter tick. bot=N runs
+ * the game N times faster by dividing the tick period by N (frames are still
+ * drawn every frame_ms). Each game's result goes to the debug console as it
+ * ends, and after bot_games=G games (1 by default) bot_report sums up and
+ * leaves QEMU with status BOT_DROPPED | BOT_LOST, or 0 for a clean run (make
+ * soak). */
+
+#define BOT_DROPPED (1 << 0) /* the governor gave up catching up */
+#define BOT_LOST    (1 << 1) /* events were lost, the queue was too short */
+
+#define BOT_PHASES (8)
+
+/* Time, ticks and frames spent with scene on top. */
+struct bot_phase {
+    const struct scene *scene;
+    u32 ms, ticks, frames;
+};
+
+struct bot {
+    bool on;
+    u32 speedup;
+    u32 games, games_max;
+    bool playing;                 /* a game started and did not end yet */
+    u32 game_start;               /* pit_ticks */
+    u32 next_key;                 /* pit_ticks when a key may be pressed */
+    u32 best, total;              /* of the scores */
+    u32 eventos_perdidos;         /* in the games that ended */
+
+    const struct scene *scene;    /* on top at the last bot_account */
+    u32 start, last, last_ticks, last_frames;
+    struct bot_phase phases[BOT_PHASES];
+    u8 n_phases;
+} bot;
+
+/* Write a line to the debug console. */
+void bot_print(const char *fmt, ...)
+{
+    char line[LOG_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    vformat(line, LOG_LINE - 1, fmt, ap);
+    va_end(ap);
+    debugcon_puts(ARCH " bot ");
+    debugcon_puts(line);
+    debugcon_puts("\n");
+}
+
+/* Number per second of n things in ms milliseconds, without dividing 64-bit
+ * numbers. */
+u32 per_second(u32 n, u32 ms)
+{
+    if (!ms)
+        return 0;
+    if (n < 0xFFFFFFFF / 1000)
+        return n * 1000 / ms;
+    return n / (ms < 1000 ? 1 : ms / 1000);
+}
+
+/* Charge the time, ticks and frames since the last call to the scene that
+ * was on top then, and remember s as the one on top now. */
+void bot_account(const struct scene *s)
+{
+    if (bot.scene) {
+        struct bot_phase *p = 0;
+        for (u8 i = 0; i < bot.n_phases; i++)
+            if (bot.phases[i].scene == bot.scene)
+                p = &bot.phases[i];
+        if (!p && bot.n_phases < BOT_PHASES) {
+            p = &bot.phases[bot.n_phases++];
+            p->scene = bot.scene;
+        }
+        if (p) {
+            p->ms += pit_ticks - bot.last;
+            p->ticks += gov.ticks - bot.last_ticks;
+            p->frames += gov.frames - bot.last_frames;
+        }
+    }
+    bot.scene = s;
+    bot.last = pit_ticks;
+    bot.last_ticks = gov.ticks;
+    bot.last_frames = gov.frames;
+}
+
+/* Sum up the run on the debug console and leave QEMU. */
+noreturn bot_report(void)
+{
+    bot_account(0);
+    u32 ms = pit_ticks - bot.start;
+    bot_print("games=%u speedup=%u ms=%u", bot.games, bot.speedup, ms);
+    bot_print("ticks=%u ticks_per_sec=%u frames=%u fps=%u skipped=%u dropped=%u",
+              gov.ticks, per_second(gov.ticks, ms), gov.frames,
+              per_second(gov.frames, ms), gov.skipped, gov.dropped);
+    bot_print("score best=%u average=%u events_lost=%u", bot.best,
+              bot.total / bot.games, bot.eventos_perdidos);
+    for (u8 i = 0; i < bot.n_phases; i++) {
+        const struct bot_phase *p = &bot.phases[i];
+        bot_print("phase %s ms=%u ticks=%u ticks_per_sec=%u frames=%u",
+                  p->scene->name, p->ms, p->ticks, per_second(p->ticks, p->ms),
+                  p->frames);
+    }
+    qemu_exit((gov.dropped ? BOT_DROPPED : 0) |
+              (bot.eventos_perdidos ? BOT_LOST : 0));
+    reset();
+}
+
+/* Record the game that just ended, and stop after the last one. */
+void bot_game_end(void)
+{
+    bot.playing = false;
+    bot.games++;
+    bot.total += juego.score;
+    if (juego.score > bot.best)
+        bot.best = juego.score;
+    bot.eventos_perdidos += juego.eventos_perdidos;
+    bot_print("game %u score=%u level=%u ms=%u", bot.games, juego.score,
+              juego.level, pit_ticks - bot.game_start);
+    if (bot.games == bot.games_max)
+        bot_report();
+}
+
+/* Level 1: fire at an enemy above the ship, or with every bullet in the air
+ * step out from under one about to land on it, or else line up with the
+ * lowest one. Lining up and firing beats stepping aside while there is a
+ * bullet left, as the homing enemies follow the ship. */
+u8 bot_level1(void)
+{
+    const struct Nave *a = &juego.aliado, *lowest = 0, *danger = 0;
+    bool fire = false, loaded = false;
+
+    if (!a->existe)
+        return 0;
+    for (u8 i = 0; i < 4; i++)
+        if (!juego.bala[i].existe)
+            loaded = true;
+    for (u8 i = 0; i < 4; i++) {
+        const struct Nave *e = &juego.enemigo[i];
+        if (!e->existe)
+            continue;
+        if (e->x <= a->x + 2 && e->x + 2 >= a->x && e->y >= a->y - 4)
+            danger = e;
+        if (e->x <= a->x + 1 && e->x + 2 >= a->x + 1)
+            fire = true;
+        if (!lowest || e->y > lowest->y)
+            lowest = e;
+    }
+    if (danger && !loaded)
+        return danger->x >= a->x ? KEY_LEFT : KEY_RIGHT;
+    if (fire && loaded)
+        return KEY_SPACE;
+    if (lowest && lowest->x != a->x)
+        return lowest->x < a->x ? KEY_LEFT : KEY_RIGHT;
+    return 0;
+}
+
+/* Level 2: stay where the corridor is now and will be after the next
+ * update, as near its middle as the rocks about to fall there allow. */
+u8 bot_level2(void)
+{
+    const struct Nave *a = &juego.aliado;
+    s8 lo = juego.position[1] + 1, hi = juego.position[1] + 8;
+    s8 next_lo = juego.position[2] + 1, next_hi = juego.position[2] + 8;
+    s8 best = a->x;
+    s16 best_cost = 0x7FFF;
+
+    if (!a->existe)
+        return 0;
+    for (s8 x = lo; x <= hi; x++) {
+        s16 cost = x - (lo + hi) / 2;
+        if (cost < 0)
+            cost = -cost;
+        if (x < next_lo || x > next_hi)
+            cost += 100;
+        for (u8 i = 0; i < 3; i++) {
+            const struct Bala *r = &juego.rocas[i];
+            if (r->existe && r->x >= x && r->x <= x + 2 &&
+                r->y >= a->y - 4 && r->y <= a->y)
+                cost += 1000;
+        }
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = x;
+        }
+    }
+    if (best < a->x && a->x - 1 >= lo)
+        return KEY_LEFT;
+    if (best > a->x && a->x + 1 <= hi)
+        return KEY_RIGHT;
+    return 0;
+}
+
+/* The key the bot presses this iteration of the main loop, or 0. */
+u8 bot_key(const struct scene *s)
+{
+    bot_account(s);
+    if ((s32) (pit_ticks - bot.next_key) < 0)
+        return 0;
+    bot.next_key = pit_ticks + (speed / 4 ? speed / 4 : 1);
+
+    if (s == &scene_level1)
+        return bot_level1();
+    if (s == &scene_level2)
+        return bot_level2();
+    if (s == &scene_transition)
+        bot_print("game %u level=2 score=%u ms=%u", bot.games + 1, juego.score,
+                  pit_ticks - bot.game_start);
+    else if (s == &scene_title || s == &scene_game_over) {
+        if (bot.playing)
+            bot_game_end();
+        if (s == &scene_title) {
+            bot.playing = true;
+            bot.game_start = pit_ticks;
+        }
+    }
+    return KEY_P;
+}
+
+#define SCENE_STACK (4)
+const struct scene *scenes[SCENE_STACK];
+u8 scene_depth = 0;
+
+const struct scene *scene_top(void)
+{
+    return scenes[scene_depth - 1];
+}
+
+void scene_push(const struct scene *s)
+{
+    klog("scene %s", s->name);
+    scenes[scene_depth++] = s;
+    gov.pending = true;
+    gov.next_tick = 0;
+    if (s->enter)
+        s->enter();
+}
+
+/* Remove the top scene and draw the one below again. */
+void scene_pop(void)
+{
+    const struct scene *s = scenes[--scene_depth];
+    if (s->exit)
+        s->exit();
+    gov.pending = true;
+    gov.next_tick = 0;
+}
+
+/* Replace the top scene with s. */
+void scene_switch(const struct scene *s)
+{
+    scene_pop();
+    scene_push(s);
+}
+
+/* Run the ticks of s that are due. */
+void scene_ticks(const struct scene *s)
+{
+    u64 period = tpms * *s->period, now = rdtsc();
+    if (!period)
+        return;
+    if (!gov.next_tick)
+        gov.next_tick = now + period;
+
+    for (u8 n = 0; now >= gov.next_tick; n++) {
+        if (n == max_catchup) {
+            gov.next_tick = now + period;
+            gov.dropped++;
+            klog("governor: %u ticks behind, dropped", max_catchup);
+            return;
+        }
+        u64 start = rdtsc();
+        bool changed = s->tick();
+        gov.tick_cycles = rdtsc() - start;
+        gov.ticks++;
+        if (scene_top() != s)
+            return;
+        gov.next_tick += period;
+        if (changed)
+            gov_redraw();
+    }
+}
+
+/* Draw s if it changed and the last frame was at least frame_ms ago. */
+void scene_frame(const struct scene *s)
+{
+    u64 now = rdtsc();
+    if (!gov.pending || now - gov.last_frame < tpms * frame_ms)
+        return;
+    gov.pending = false;
+    gov.last_frame = now;
+
+    s->draw();
+    if (show_stats)
+        draw_stats();
+    present();
+    boot_mark(BOOT_FRAME);
+
+    gov.frame_cycles = rdtsc() - now;
+    gov.frames++;
+    if (pit_ticks - gov.second >= PIT_HZ) {
+        gov.fps = gov.frames - gov.second_frames;
+        gov.second_frames = gov.frames;
+        gov.second = pit_ticks;
+    }
+}
+
+noreturn scene_run(void)
+{
+    while (true) {
+        const struct scene *s = scene_top();
+
+        tps();
+        boot_trace();
+
+        console_poll();
+        tunables_apply();
+
+        u8 key = bot.on ? bot_key(s) : scan();
+        if (key == KEY_R)
+            reset();
+        if (key && s->input && s->input(key))
+            gov_redraw();
+        if (s->poll && scene_top() == s && s->poll())
+            gov_redraw();
+        if (s->tick && scene_top() == s)
+            scene_ticks(s);
+
+        sound_flush(&juego);
+        disk_step();
+
+        if (scene_top() != s)
+            continue; /* the new scene is drawn on the next iteration */
+        scene_frame(s);
+        if (s->is_static && !gov.pending)
+            asm volatile("hlt");
+    }
+}
+
+/* Controls shown next to the well. */
+void draw_controls(bool shoot, bool pause)
+{
+    if (shoot) {
+        puts(1, 16, BRIGHT | GRAY, BLACK, "SPACE");
+        puts(7, 16, GRAY,          BLACK, "- Shoot");
+    }
+    if (pause) {
+        puts(1, 17, BRIGHT | GRAY, BLACK, "P");
+        puts(7, 17, GRAY,          BLACK, "- Pause");
+    }
     puts(1, 18, BRIGHT | GRAY, BLACK, "R");
     puts(7, 18, GRAY,          BLACK, "- Reset");
+}
 
-    updated = false;
+/* Clear the screen for a scene that draws everything itself. */
+void clear_screen(void)
+{
+    clear(BLACK);
+}
 
-    if ((key = scan())) {
-        last_key = key;
-        switch(key) {
-        case KEY_R:
-            reset();
-        case KEY_LEFT:
-            move_bichito2(-1, 0);
-            break;
-        case KEY_RIGHT:
-            move_bichito2(1, 0);
-            break;
-        case KEY_P:
-            if (game_over)
-                break;
-            clear(BLACK);
-            paused = !paused;
-            break;
-        }
-        updated = true;
+/* Title */
+
+void title_enter(void)
+{
+    clear(BLACK);
+    juego_nuevo(&juego);
+}
+
+bool title_input(u8 key)
+{
+    if (key != KEY_P)
+        return false;
+    if (!bot.on || !bot.games)
+        calibrate(); /* tps keeps it up to date between the bot's games */
+    if (netplay) {
+        net_reset();
+        net_handshake();
+        scene_switch(&scene_netplay);
+    } else
+        scene_switch(&scene_level1);
+    return false;
+}
+
+const struct scene scene_title = {
+    .name = "title",
+    .enter = title_enter,
+    .input = title_input,
+    .draw = draw_about,
+    .is_static = true,
+};
+
+/* Log the events the last juego_resolver applied. */
+void log_eventos(void)
+{
+    static const char *const nombres[EVENTO__LENGTH] = {
+        [EVENTO_HIT] = "hit",
+        [EVENTO_ROCA] = "roca",
+        [EVENTO_MUERTE] = "muerte",
+        [EVENTO_SCORE] = "score",
+    };
+    for (u8 i = 0; i < juego.n_aplicados; i++)
+        klog("%s %u %u score=%u vidas=%u", nombres[juego.aplicados[i].tipo],
+             juego.aplicados[i].a, juego.aplicados[i].b, juego.score, juego.vidas);
+}
+
+/* Level 1 */
+
+void level1_enter(void)
+{
+    spawn(&juego);
+    clear(BLACK);
+}
+
+/* Resolve the consequences of a move or update and leave the level if it
+ * ended. */
+bool level1_check(void)
+{
+    check_collisions(&juego);
+    juego_resolver(&juego);
+    log_eventos();
+    check_level_change(&juego);
+    check_game_over(&juego);
+    if (juego.game_over)
+        scene_switch(&scene_game_over);
+    else if (juego.level2)
+        scene_switch(&scene_transition);
+    return true;
+}
+
+bool level1_input(u8 key)
+{
+    switch (key) {
+    case KEY_LEFT:
+        move_bichito(&juego, -1, 0);
+        break;
+    case KEY_RIGHT:
+        move_bichito(&juego, 1, 0);
+        break;
+    case KEY_SPACE:
+        disparar(&juego);
+        break;
+    case KEY_P:
+        scene_push(&scene_pause);
+        return false;
     }
+    return level1_check();
+}
 
-    if (!paused && !game_over && interval(TIMER_UPDATE, speed)) {
-        update2();
-        updated = true;
-        if (pos < 4) {
-    		pos++;
-	    }
-	    if (pos == 4) {
-	    	pos = 0;
-	    }
+bool level1_tick(void)
+{
+    update(&juego);
+    juego.pos = (juego.pos + 1) % 4;
+    return level1_check();
+}
+
+void level1_draw(void)
+{
+    draw_controls(true, true);
+    draw(juego.pos);
+}
+
+const struct scene scene_level1 = {
+    .name = "level1",
+    .enter = level1_enter,
+    .input = level1_input,
+    .tick = level1_tick,
+    .period = &speed,
+    .draw = level1_draw,
+};
+
+/* Between levels 1 and 2 */
+
+bool transition_input(u8 key)
+{
+    if (key != KEY_P)
+        return false;
+    inicializar2(&juego);
+    scene_switch(&scene_level2);
+    return false;
+}
+
+const struct scene scene_transition = {
+    .name = "transition",
+    .enter = clear_screen,
+    .input = transition_input,
+    .draw = draw_level_2,
+    .is_static = true,
+};
+
+/* Level 2 */
+
+bool level2_check(void)
+{
+    check_collisions_pared(&juego);
+    check_collisions_rocas(&juego);
+    juego_resolver(&juego);
+    log_eventos();
+    check_game_over(&juego);
+    if (juego.game_over)
+        scene_switch(&scene_game_over);
+    else if (juego.score >= juego.reglas.puntos_fin) {
+        sound_play(SOUND_LEVEL);
+        hiscore_submit(juego.score, juego.level);
+        scene_switch(&scene_title);
     }
+    return true;
+}
 
-    if (updated) {
-    	collide2(aliado.x, aliado.y);
-        draw2(pos);
-        check_collisions_rocas();
-        check_game_over();
-        if (game_over){
-			clear(BLACK);
-			goto loop2;
-		}
-		if (score >= 35){
-			clear(BLACK);
-			score = 0;
-			level2 = false;
-			level = 1;
-			vidas = 3;
-			goto loop0;
-		}
+bool level2_input(u8 key)
+{
+    switch (key) {
+    case KEY_LEFT:
+        move_bichito2(&juego, -1, 0);
+        break;
+    case KEY_RIGHT:
+        move_bichito2(&juego, 1, 0);
+        break;
+    case KEY_P:
+        scene_push(&scene_pause);
+        return false;
     }
+    return level2_check();
+}
 
-    goto loop3;
+bool level2_tick(void)
+{
+    update2(&juego);
+    juego.pos = (juego.pos + 1) % 4;
+    return level2_check();
+}
 
-loop4:
+void level2_draw(void)
+{
+    draw_controls(false, true);
+    draw2(juego.pos);
+}
+
+const struct scene scene_level2 = {
+    .name = "level2",
+    .enter = clear_screen,
+    .input = level2_input,
+    .tick = level2_tick,
+    .period = &speed,
+    .draw = level2_draw,
+};
+
+/* Game over */
+
+void game_over_enter(void)
+{
+    clear(BLACK);
+    hiscore_submit(juego.score, juego.level);
+}
+
+bool game_over_input(u8 key)
+{
+    if (key == KEY_P)
+        scene_switch(&scene_title);
+    return false;
+}
+
+const struct scene scene_game_over = {
+    .name = "game_over",
+    .enter = game_over_enter,
+    .input = game_over_input,
+    .draw = draw_game_over,
+    .is_static = true,
+};
 
-	draw_level_2();
+/* Pause, on top of a level. The level's own draw shows the about screen while
+ * paused is set. */
 
-	if ((key=scan())){
-		if (key == KEY_P){ 
-			inicializar2();
-			clear(BLACK);
-			goto loop3;
-		}
-	}
+void pause_enter(void)
+{
+    paused = true;
+    clear(BLACK);
+}
+
+void pause_exit(void)
+{
+    paused = false;
+    clear(BLACK);
+}
 
-	goto loop4;
+bool pause_input(u8 key)
+{
+    if (key == KEY_P)
+        scene_pop();
+    return false;
+}
+
+void pause_draw(void)
+{
+    scenes[scene_depth - 2]->draw();
+}
+
+const struct scene scene_pause = {
+    .name = "pause",
+    .enter = pause_enter,
+    .input = pause_input,
+    .draw = pause_draw,
+    .exit = pause_exit,
+    .is_static = true,
+};
 
+/* Level 1 with two players, one on each side of the serial link. Ticks are
+ * paced by net_advance, which also waits for a peer that falls behind. */
 
+bool netplay_input(u8 key)
+{
+    switch (key) {
+    case KEY_LEFT:
+        net_pending |= INPUT_LEFT;
+        break;
+    case KEY_RIGHT:
+        net_pending |= INPUT_RIGHT;
+        break;
+    case KEY_SPACE:
+        net_pending |= INPUT_FIRE;
+        break;
+    }
+    return false;
+}
+
+bool netplay_poll(void)
+{
+    bool updated = false;
+
+    net_poll();
+    if (net_rollback())
+        updated = true;
+    if (!juego.game_over && net_advance())
+        updated = true;
+
+    /* Only leave once the peer's inputs confirm the game really ended. */
+    if (juego.game_over && net_confirmed >= net_tick)
+        scene_switch(&scene_game_over);
+    return updated;
+}
+
+void netplay_draw(void)
+{
+    draw_controls(true, false);
+    draw(juego.pos);
+    draw_net();
+}
+
+const struct scene scene_netplay = {
+    .name = "netplay",
+    .enter = level1_enter,
+    .input = netplay_input,
+    .poll = netplay_poll,
+    .draw = netplay_draw,
+};
+
+noreturn kernel_main(u32 magic, const struct multiboot_info *mbi)
+{
+    boot_mark(BOOT_MAIN);
+    if (magic == MULTIBOOT_MAGIC && (mbi->flags & MULTIBOOT_CMDLINE))
+        cmdline = (const char *) (uptr) mbi->cmdline;
+
+    vector_init();
+
+    const char *opt;
+
+    /* video=80x50 or video=90x60 picks a bigger text mode, and the well and
+     * HUD grow to fill it */
+    opt = cmdline_opt("video");
+    if (opt) {
+        u32 c = atou(opt);
+        while (*opt >= '0' && *opt <= '9')
+            opt++;
+        if (*opt == 'x')
+            text_mode(c, atou(opt + 1));
+    }
+    juego_pozo(&juego, (cols - 36) / 2, rows - 5);
+    juego_reglas(&juego);
+
+    /* netplay=1 or netplay=2 picks which of the two ships this side drives */
+    opt = cmdline_opt("netplay");
+    if (opt) {
+        netplay = true;
+        juego.dos_jugadores = true;
+        net_player = atou(opt) == 2;
+        serial_init(NET_PORT);
+    }
+
+    idt_init();
+    pit_init();
+    asm volatile("sti");
+
+    boot_tracing = cmdline_opt("boottrace") != 0;
+    show_stats = cmdline_opt("stats") != 0;
+    logging = cmdline_opt("log") != 0;
+    console = cmdline_opt("console") != 0;
+    uart_init();
+    klog("boot %ux%u well %ux%u sse2=%u", cols, rows, juego.ancho, juego.alto,
+         fill16 == fill16_sse2);
+    if (console) {
+        console_print(TETRIS_NAME " console, type help");
+        uart_write("> ", 2);
+    }
+
+    mem_report(klog);
+
+    disk_present = ata_init();
+    hiscore_load();
+
+    if (cmdline_opt("bench"))
+        benchmark();
+
+    /* bot=N plays by itself N times faster, for bot_games=G games */
+    opt = cmdline_opt("bot");
+    if (opt && !netplay) {
+        bot.on = true;
+        bot.speedup = atou(opt) ? atou(opt) : 1;
+        speed = INITIAL_SPEED / bot.speedup ? INITIAL_SPEED / bot.speedup : 1;
+        opt = cmdline_opt("bot_games");
+        bot.games_max = opt && atou(opt) ? atou(opt) : 1;
+        bot.start = pit_ticks;
+        bot_print("games=%u speedup=%u speed=%u", bot.games_max, bot.speedup, speed);
+    }
 
+    scene_push(&scene_title);
+    scene_run();
 }
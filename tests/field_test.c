@@ -0,0 +1,92 @@
+/* Host-side check of the flow field in game.c: however it was patched (rocks
+ * falling, the level 2 corridor scrolling, obstacles covering a player's goal
+ * cells and leaving them), the field must be the one field_build makes from
+ * scratch. make test */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "game.h"
+
+static struct juego j;
+static struct campo campo;
+
+/* Compare the field as patched with a rebuilt one, return 1 if they differ. */
+static int check(const char *what, int step)
+{
+    static u8 dir[FIELD_CELLS];
+    static u16 dist[FIELD_CELLS];
+
+    field_update(&j);
+    memcpy(dir, j.campo->dir, sizeof(dir));
+    memcpy(dist, j.campo->dist, sizeof(dist));
+    j.campo->valid = false;
+    field_update(&j);
+
+    for (u16 cell = 0; cell < j.ancho * j.alto; cell++)
+        if (dir[cell] != j.campo->dir[cell] || dist[cell] != j.campo->dist[cell]) {
+            printf("%s, step %d: cell %u,%u patched dist %u dir %u, built dist %u dir %u\n",
+                   what, step, cell % j.ancho, cell / j.ancho, dist[cell], dir[cell],
+                   j.campo->dist[cell], j.campo->dir[cell]);
+            return 1;
+        }
+    return 0;
+}
+
+/* A level 2 game with a homing enemy about, so the field is kept. */
+static void start(void)
+{
+    memset(&j, 0, sizeof(j));
+    j.campo = &campo;
+    juego_nuevo(&j);
+    j.level2 = true;
+    inicializar2(&j);
+    j.aliado.existe = true;
+    j.enemigo[0].existe = true;
+    field_update(&j);
+}
+
+/* Scroll the corridor as update2 does. */
+static void scroll(void)
+{
+    u32 first = j.position[0];
+    for (u8 i = 0; i < j.alto - 1; i++)
+        j.position[i] = j.position[i + 1];
+    j.position[j.alto - 1] = first;
+}
+
+int main(void)
+{
+    int failed = 0;
+    srand(1);
+
+    /* rocks falling and jumping about while the corridor scrolls */
+    start();
+    for (int step = 0; step < 5000 && !failed; step++) {
+        scroll();
+        for (u8 i = 0; i < 3; i++) {
+            struct Bala *r = &j.rocas[i];
+            if (rand() % 8 == 0) {
+                r->x = rand() % j.ancho;
+                r->y = rand() % j.alto;
+                r->existe = rand() % 4 != 0;
+            } else
+                r->y = (r->y + 1) % j.alto;
+        }
+        failed |= check("rocks", step);
+    }
+
+    /* a rock on and off every goal cell of the ship */
+    start();
+    for (s8 y = j.aliado.y - 1; y <= j.aliado.y + 1 && !failed; y++)
+        for (s8 x = j.aliado.x - 2; x <= j.aliado.x + 2 && !failed; x++) {
+            j.rocas[0] = (struct Bala) {x, y, true};
+            failed |= check("rock on a goal cell", x * 100 + y);
+            j.rocas[0].existe = false;
+            failed |= check("rock off a goal cell", x * 100 + y);
+        }
+
+    puts(failed ? "field: FAILED" : "field: ok");
+    return failed;
+}
@@ -0,0 +1,79 @@
+/* Host-side checks of the game rules in game.c, driven the way the kernel's
+ * level scenes drive them: update() on its own, without juego_tick. make test */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "game.h"
+
+static struct juego j;
+static struct campo campo;
+
+/* A level 1 game with the default rules. */
+static void start(void)
+{
+    memset(&j, 0, sizeof(j));
+    j.campo = &campo;
+    juego_nuevo(&j);
+}
+
+/* Count the updates out of n that spawn an enemy, with none left over from
+ * the update before. */
+static int spawns(u32 spawn_cada, int n)
+{
+    int count = 0;
+    start();
+    j.reglas.spawn_cada = spawn_cada;
+    for (int i = 0; i < n; i++) {
+        for (u8 e = 0; e < 4; e++)
+            j.enemigo[e].existe = false;
+        update(&j);
+        for (u8 e = 0; e < 4; e++)
+            count += j.enemigo[e].existe;
+    }
+    return count;
+}
+
+/* Put enemy 0, bullet 0 if bala, and the ships given on the same cell, and
+ * resolve one tick of collisions. Return the lives lost. */
+static u32 crash(bool bala, bool aliado, bool companero)
+{
+    start();
+    j.dos_jugadores = true;
+    j.enemigo[0] = (struct Nave) {.x = 5, .y = 10, .existe = true};
+    j.bala[0] = (struct Bala) {5, 10, bala};
+    j.aliado = (struct Nave) {.x = 5, .y = 10, .existe = aliado};
+    j.companero = (struct Nave) {.x = 5, .y = 10, .existe = companero};
+    u32 vidas = j.vidas;
+    check_collisions(&j);
+    juego_resolver(&j);
+    return vidas - j.vidas;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    /* spawn_every from the console is obeyed by update alone */
+    int got = spawns(1, 20), want = 20;
+    if (got == want)
+        got = spawns(5, 20), want = 4;
+    if (got != want) {
+        printf("spawn: %d enemies in 20 updates, want %d\n", got, want);
+        failed = 1;
+    }
+
+    /* an enemy shot in the tick it reaches a ship takes no life, and an
+     * enemy reaching both ships takes one */
+    if (crash(true, true, false) != 0 || j.score != j.reglas.puntos_hit) {
+        printf("hit: ship lost a life to an enemy shot the same tick\n");
+        failed = 1;
+    }
+    if (crash(false, true, true) != 1 || !j.companero.existe) {
+        printf("hit: one enemy took %u lives from two ships\n", j.reglas.vidas - j.vidas);
+        failed = 1;
+    }
+
+    puts(failed ? "juego: FAILED" : "juego: ok");
+    return failed;
+}
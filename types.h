@@ -0,0 +1,23 @@
+/* Fixed width integer types and bool, shared by every part of the game. None
+ * of the standard headers are available to the kernel. */
+
+#ifndef TYPES_H
+#define TYPES_H
+
+typedef unsigned char      u8;
+typedef signed   char      s8;
+typedef unsigned short     u16;
+typedef signed   short     s16;
+typedef unsigned int       u32;
+typedef signed   int       s32;
+typedef unsigned long long u64;
+typedef signed   long long s64;
+typedef __SIZE_TYPE__      usize;
+typedef __UINTPTR_TYPE__   uptr;
+
+typedef enum bool {
+    false,
+    true
+} bool;
+
+#endif